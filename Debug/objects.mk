@@ -4,5 +4,5 @@
 
 USER_OBJS :=
 
-LIBS := -lopencv_core  -lopencv_imgcodecs -lopencv_video  -lopencv_features2d  -lopencv_calib3d  -lopencv_objdetect  -lopencv_flann -lopencv_imgproc  -lopencv_highgui  -lopencv_ml
+LIBS := -lopencv_core  -lopencv_imgcodecs -lopencv_video  -lopencv_features2d  -lopencv_calib3d  -lopencv_objdetect  -lopencv_flann -lopencv_imgproc  -lopencv_highgui  -lopencv_ml -lpthread -lrt
 
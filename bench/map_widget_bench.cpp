@@ -0,0 +1,353 @@
+/*
+ * map_widget_bench.cpp
+ *
+ * Headless benchmark of MapWidget: it replays a seeded sequence of pans and marker moves without any window
+ * and reports frames/sec, per-call latencies of draw() and marker_update(), the heap allocations and the image buffer ones
+ */
+
+#include "../src/map_widget.h"
+
+#include <atomic>
+#include <chrono>
+#include <new>
+#include <random>
+#include <iostream>
+
+//Heap allocations counter; it counts every operator new of the process
+static std::atomic<unsigned long long> allocations(0), allocated_bytes(0);
+
+void* operator new(std::size_t size) {
+	allocations++, allocated_bytes += size;
+	if (void* ptr = std::malloc(size ? size : 1)) return ptr;
+	throw std::bad_alloc();
+}
+//The deletes are not inlined, otherwise the compiler sees free() of the operator new memory at the call sites
+__attribute__((noinline)) void operator delete(void* ptr) noexcept { std::free(ptr); }
+__attribute__((noinline)) void operator delete(void* ptr, std::size_t) noexcept { std::free(ptr); }
+
+//Image buffers counter; cv::Mat buffers come from cv::fastMalloc, not from operator new, so the default allocator is wrapped
+static std::atomic<unsigned long long> image_buffers(0), image_bytes(0);
+
+class bench_mat_allocator_t : public cv::MatAllocator {
+private:
+	const cv::MatAllocator* std_allocator = cv::Mat::getStdAllocator();
+public:
+	//The buffers are made by the standard allocator and stay owned by it (UMatData::currAllocator), so only their creation passes here
+	cv::UMatData* allocate(int dims, const int* sizes, int type, void* data, size_t* step, int flags, cv::UMatUsageFlags usage_flags) const override {
+		cv::UMatData* buffer = this->std_allocator->allocate(dims, sizes, type, data, step, flags, usage_flags);
+		if ( (buffer) && (!data) ) image_buffers++, image_bytes += buffer->size;
+		return buffer;
+	}
+	bool allocate(cv::UMatData* buffer, int access_flags, cv::UMatUsageFlags usage_flags) const override { return this->std_allocator->allocate(buffer, access_flags, usage_flags); }
+	void deallocate(cv::UMatData* buffer) const override { this->std_allocator->deallocate(buffer); }
+};
+static bench_mat_allocator_t mat_allocator;
+
+//The benchmark options
+struct bench_options_t {
+	std::string scenario = "walk";               //walk (the demo random walk), uniform or cluster
+	std::string map_image, marker_image;         //Decoded images; synthetic ones are used if empty
+	std::string trace;                           //CSV trace of the per-step render counters (MapWidget::set_stats_trace())
+	std::string export_name;                     //Shared memory frame ring the frames are published into (MapFrameExporter)
+	std::string tiles;                           //Raw tile file the map is written into and served from (MapTiledBackground)
+	bool pipeline = false;                       //Render on the pipeline thread (MapWidgetPipeline)
+	unsigned int zoom = 0;                       //MapWidget::set_zoom()
+	coord2D_t<unsigned int> map_size    = { 5336, 3264 };
+	coord2D_t<unsigned int> window_size = { 640, 480 };
+	unsigned int markers = 0;                    //0 is 4 for the walk and 1000 for the synthetic scenarios
+	unsigned int steps = 10000;
+	unsigned int moves = 16;                     //Markers moved per step of the synthetic scenarios
+	unsigned int seed = 2004;
+	unsigned int bands = 1;                      //MapWidget::set_render_bands()
+	bool incremental = true;                     //MapWidget::set_incremental_pan()
+	bool solver = false;                         //MapWidget::set_orient_solver()
+	bool save_under = true;                      //MapWidget::set_save_under()
+	unsigned int views = 1;                      //Views of the shared map; the extra ones follow the pans at offsets
+};
+
+//The per-call latencies (microseconds)
+struct bench_latency_t {
+	std::vector<double> samples;
+
+	template<typename F>
+	void measure(F f) {
+		auto start = std::chrono::steady_clock::now();
+		f();
+		this->samples.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count());
+	}
+	double percentile(double p) {
+		if (this->samples.empty()) return 0.;
+		size_t _i = (size_t)(p * (double)(this->samples.size() - 1) + 0.5);
+		std::nth_element(this->samples.begin(), this->samples.begin() + _i, this->samples.end());
+		return this->samples[_i];
+	}
+	void print(const char* name) {
+		double total = 0.;
+		for (double sample : this->samples) total += sample;
+		printf("%-16s calls %9zu  mean %9.2f us  p50 %9.2f us  p99 %9.2f us\n", name, this->samples.size(), (this->samples.empty()) ? 0. : total / (double)this->samples.size(), this->percentile(0.5), this->percentile(0.99));
+	}
+};
+
+//This function makes a deterministic synthetic image
+static cv::Mat synthetic_image(unsigned int size_x, unsigned int size_y, unsigned int pattern) {
+	cv::Mat image(size_y, size_x, CV_8UC3);
+	for (unsigned int _y=0 ; _y != size_y; _y++) {
+		unsigned char* row = image.ptr<unsigned char>(_y);
+		for (unsigned int _x=0 ; _x != size_x; _x++) row[3*_x+0] = (unsigned char)((_x ^ _y) + pattern), row[3*_x+1] = (unsigned char)(_x >> 2), row[3*_x+2] = (unsigned char)((_y >> 2) * pattern);
+	}
+	return image;
+}
+
+//This function returns true if the images have the same pixels
+static bool same_image(const cv::Mat& image1, const cv::Mat& image2) {
+	if ( (image1.rows != image2.rows) || (image1.cols != image2.cols) || (image1.type() != image2.type()) ) return false;
+	for (int _r=0 ; _r != image1.rows; _r++)
+		if (std::memcmp(image1.ptr<unsigned char>(_r), image2.ptr<unsigned char>(_r), image1.cols * image1.elemSize())) return false;
+	return true;
+}
+
+//This function parses "WxH"
+static bool parse_size(const char* text, coord2D_t<unsigned int>& size) {
+	return sscanf(text, "%ux%u", &size.x, &size.y) == 2;
+}
+
+static void usage(const char* name) {
+	printf("usage: %s [options]\n"
+		"  --scenario walk|uniform|cluster  the demo random walk or N markers spread uniformly / clustered (walk)\n"
+		"  --map WxH                        synthetic map size (5336x3264)\n"
+		"  --image PATH                     decoded map image instead of the synthetic one\n"
+		"  --marker-image PATH              decoded marker image instead of the synthetic one\n"
+		"  --window WxH                     output window size (640x480)\n"
+		"  --markers N                      markers (4 for walk, 1000 otherwise)\n"
+		"  --steps N                        replayed steps (10000)\n"
+		"  --moves N                        markers moved per step of the synthetic scenarios (16)\n"
+		"  --seed N                         random seed (2004)\n"
+		"  --bands N                        render bands of the full re-drawing (1)\n"
+		"  --incremental 0|1                scroll the rendered image on small pans (1)\n"
+		"  --solver 0|1                     orient the markers to overlap each other the least (0)\n"
+		"  --save-under 0|1                 back up the background under the markers; 0 recomposes erased frames (1)\n"
+		"  --views N                        views of the shared map drawn in parallel; the extra ones follow the pans at offsets (1)\n"
+		"  --zoom N                         replay at the zoom level (0)\n"
+		"  --tiles PATH                     write the map into the raw tile file and serve it through the tile cache\n"
+		"  --export NAME                    publish every step into the shared memory frame ring (e.g. /map_bench) and read it back\n"
+		"  --pipeline                       queue the commands to the render thread; every step is flushed and its frame acquired\n"
+		"  --trace PATH                     CSV trace of the per-step render counters (build with -DMAP_WIDGET_STATS)\n", name);
+}
+
+int main(int argc, char** argv) {
+	cv::Mat::setDefaultAllocator(&mat_allocator);
+	bench_options_t options;
+	for (int _i=1 ; _i < argc; _i++) {
+		std::string arg = argv[_i];
+		const char* value = (_i + 1 < argc) ? argv[_i + 1] : nullptr;
+		bool ok = (value != nullptr);
+		if (arg == "--pipeline") { options.pipeline = true; continue; }
+		if      (arg == "--scenario")     options.scenario = (ok) ? value : "";
+		else if (arg == "--map")          ok = (ok) && (parse_size(value, options.map_size));
+		else if (arg == "--image")        options.map_image = (ok) ? value : "";
+		else if (arg == "--marker-image") options.marker_image = (ok) ? value : "";
+		else if (arg == "--window")       ok = (ok) && (parse_size(value, options.window_size));
+		else if (arg == "--markers")      options.markers = (ok) ? (unsigned int)std::atoi(value) : 0;
+		else if (arg == "--steps")        options.steps = (ok) ? (unsigned int)std::atoi(value) : 0;
+		else if (arg == "--moves")        options.moves = (ok) ? (unsigned int)std::atoi(value) : 0;
+		else if (arg == "--seed")         options.seed = (ok) ? (unsigned int)std::atoi(value) : 0;
+		else if (arg == "--bands")        options.bands = (ok) ? (unsigned int)std::atoi(value) : 1;
+		else if (arg == "--incremental")  options.incremental = (ok) && (std::atoi(value) != 0);
+		else if (arg == "--solver")       options.solver = (ok) && (std::atoi(value) != 0);
+		else if (arg == "--save-under")   options.save_under = (ok) && (std::atoi(value) != 0);
+		else if (arg == "--views")        options.views = (ok) ? (unsigned int)std::atoi(value) : 0;
+		else if (arg == "--zoom")         options.zoom = (ok) ? (unsigned int)std::atoi(value) : 0;
+		else if (arg == "--tiles")        options.tiles = (ok) ? value : "";
+		else if (arg == "--export")       options.export_name = (ok) ? value : "";
+		else if (arg == "--trace")        options.trace = (ok) ? value : "";
+		else ok = false;
+		if ( (!ok) || (!options.views) || ( (options.scenario != "walk") && (options.scenario != "uniform") && (options.scenario != "cluster") ) ) { usage(argv[0]); return 1; }
+		_i++;
+	}
+	if (!options.markers) options.markers = (options.scenario == "walk") ? 4 : 1000;
+	if ( (options.pipeline) && ( (options.views > 1) || (!options.export_name.empty()) ) ) { printf("The pipeline renders one view and takes its damage itself: --views and --export do not apply\n"); return 1; }
+
+	cv::Mat background_image = (options.map_image.empty()) ? synthetic_image(options.map_size.x, options.map_size.y, 1) : cv::imread(options.map_image, CV_LOAD_IMAGE_COLOR);
+	cv::Mat player_image = (options.marker_image.empty()) ? synthetic_image(104, 120, 7) : cv::imread(options.marker_image, CV_LOAD_IMAGE_COLOR);
+	if ( (background_image.empty()) || (player_image.empty()) ) { printf("Failed to load the images\n"); return 1; }
+	if ( (background_image.cols < (int)options.window_size.x + 20) || (background_image.rows < (int)options.window_size.y + 20) ) { printf("The map is smaller than the window\n"); return 1; }
+
+	try {
+		//The walk starts in the map corner as the demo does; the synthetic scenarios start in the map center
+		coord2D_t<unsigned int> map_origin = { (unsigned int)background_image.cols - 1, (unsigned int)background_image.rows - 1 };
+		if (options.scenario != "walk") map_origin.x /= 2, map_origin.y /= 2;
+		std::shared_ptr<MapBackground> background;
+		if (!options.tiles.empty()) {
+			MapRawTileSource::write(options.tiles, background_image, 256);
+			background = std::make_shared<MapTiledBackground>(std::unique_ptr<MapTileSource>(new MapRawTileSource(options.tiles)));
+		}
+		else background = std::make_shared<MapImageBackground>(background_image);
+		std::unique_ptr<MapWidget> map_owner(new MapWidget(map_origin.x, map_origin.y, options.window_size.x, options.window_size.y, background));
+		MapWidget& map = *map_owner; //The pipeline takes the map over but it stays alive; it is read between the flushed steps only
+		if (map.set_zoom(options.zoom) == -1) { printf("The map has %u zoom levels\n", map.zoom_levels()); return 1; }
+		map.set_incremental_pan(options.incremental);
+		map.set_render_bands(options.bands);
+		map.set_orient_solver(options.solver);
+		map.set_save_under(options.save_under);
+		map.set_stats_trace(options.trace);
+
+		//The extra views of the shared map are centered around the main one by half a window
+		std::vector<std::unique_ptr<MapWidget>> views;
+		auto view_center = [&map, &map_origin](unsigned int view) {
+			int dx = (int)(view % 3) - 1, dy = (int)((view / 3) % 3) - 1;
+			return coord2D_t<unsigned int>{ (unsigned int)std::min(std::max((int)map_origin.x + dx * (int)map.window_size.x/2, 0), (int)map.map_size.x - 1), (unsigned int)std::min(std::max((int)map_origin.y + dy * (int)map.window_size.y/2, 0), (int)map.map_size.y - 1) };
+		};
+		for (unsigned int _v=1 ; _v < options.views; _v++) {
+			coord2D_t<unsigned int> center = view_center(_v);
+			views.push_back(std::make_unique<MapWidget>(center.x, center.y, options.window_size.x, options.window_size.y, map.model));
+			views.back()->set_incremental_pan(options.incremental);
+			views.back()->set_render_bands(options.bands);
+			views.back()->set_orient_solver(options.solver);
+			views.back()->set_save_under(options.save_under);
+			views.back()->set_zoom(options.zoom);
+		}
+
+		std::mt19937 rng(options.seed);
+		std::normal_distribution<double> cluster_x(map_origin.x, options.window_size.x / 8.), cluster_y(map_origin.y, options.window_size.y / 8.);
+		std::vector<coord2D_t<unsigned int>> markers_coord2D(options.markers, map_origin);
+		for (unsigned int _j=0 ; _j != options.markers; _j++) {
+			unsigned char color[3] = { (unsigned char)(_j * 40), (unsigned char)(255 - _j * 20), (unsigned char)(_j * 7) };
+			if (options.scenario == "uniform") markers_coord2D[_j] = { (unsigned int)(rng() % map.map_size.x), (unsigned int)(rng() % map.map_size.y) };
+			if (options.scenario == "cluster") markers_coord2D[_j] = { (unsigned int)std::min(std::max(cluster_x(rng), 0.), map.map_size.x - 1.), (unsigned int)std::min(std::max(cluster_y(rng), 0.), map.map_size.y - 1.) };
+			map.marker_add(markers_coord2D[_j].x, markers_coord2D[_j].y, color, 0.2, 0.4, 4, 4, 64, 64, player_image);
+		}
+		map.model->draw();
+		map.take_stats(); //The stats frames are the replayed steps
+
+		//The delivered frames are compared with the map image
+		std::unique_ptr<MapWidgetPipeline> pipeline;
+		std::unique_ptr<MapFrameExporter> exporter;
+		std::unique_ptr<MapFrameReader> reader;
+		if (options.pipeline) pipeline.reset(new MapWidgetPipeline(std::move(map_owner)));
+		if (!options.export_name.empty()) {
+			exporter.reset(new MapFrameExporter(options.export_name, options.window_size.x, options.window_size.y));
+			reader.reset(new MapFrameReader(options.export_name));
+		}
+		unsigned long long frames_delivered = 0, frames_mismatched = 0, damaged_pixels = 0;
+
+		bench_latency_t draw_latency, update_latency, deliver_latency;
+		map_stats_t total = map_stats_t();
+		unsigned long long start_allocations = allocations, start_bytes = allocated_bytes, start_image_buffers = image_buffers, start_image_bytes = image_bytes;
+		auto start = std::chrono::steady_clock::now();
+		std::srand(options.seed);
+		for (unsigned int _i=0 ; _i != options.steps; _i++) {
+			//Map movement; the same rules as the demo
+			if (!(_i%10)) {
+				bool flag = false;
+				switch (std::rand() % 3) {
+					case  1 : { if (map_origin.x < map.map_size.x - map.window_size.x/2 - 10) { map_origin.x+=10, flag = true; } break; }
+					case  2 : { if (map_origin.x > map.window_size.x/2 + 10)                   { map_origin.x-=10, flag = true; } break; }
+					default : ;
+				}
+				switch (std::rand() % 3) {
+					case  1 : { if (map_origin.y < map.map_size.y - map.window_size.y/2 - 10) { map_origin.y+=10, flag = true; } break; }
+					case  2 : { if (map_origin.y > map.window_size.y/2 + 10)                   { map_origin.y-=10, flag = true; } break; }
+					default : ;
+				}
+				if ( (flag) && (pipeline) ) draw_latency.measure([&pipeline, &map_origin] { pipeline->set_center(map_origin.x, map_origin.y); });
+				else if ( (flag) && (map.set_center(map_origin.x, map_origin.y) == +1) ) {
+					for (unsigned int _v=1 ; _v < options.views; _v++) views[_v-1]->set_center(view_center(_v).x, view_center(_v).y);
+					draw_latency.measure([&map] { map.model->draw(); });
+				}
+			}
+			else if (options.scenario == "walk") {
+				//Marker movements of the demo; they are applied in one batch per step as the demo does (the pipeline batches its queue itself)
+				std::vector<unsigned int> marker_ids;
+				std::vector<coord2D_t<unsigned int>> marker_coords;
+				for (unsigned int _j=0 ; _j != options.markers; _j++) {
+					bool flag = false;
+					switch (std::rand() % 3) {
+						case  1 : { if (markers_coord2D[_j].x <  map_origin.x + map.window_proj.size_x - 10) { markers_coord2D[_j].x+=10, flag = true; } break; }
+						case  2 : { if (markers_coord2D[_j].x >= map_origin.x - map.window_proj.x      + 10) { markers_coord2D[_j].x-=10, flag = true; } break; }
+						default : ;
+					}
+					switch (std::rand() % 3) {
+						case  1 : { if (markers_coord2D[_j].y <  map_origin.y + map.window_proj.size_y - 10) { markers_coord2D[_j].y+=10, flag = true; } break; }
+						case  2 : { if (markers_coord2D[_j].y >= map_origin.y - map.window_proj.y      + 10) { markers_coord2D[_j].y-=10, flag = true; } break; }
+						default : ;
+					}
+					if ( (flag) && (pipeline) ) update_latency.measure([&pipeline, &markers_coord2D, _j] { pipeline->marker_update(_j, markers_coord2D[_j].x, markers_coord2D[_j].y); });
+					else if ( (flag)) marker_ids.push_back(_j), marker_coords.push_back(markers_coord2D[_j]);
+				}
+				if (!marker_ids.empty()) update_latency.measure([&map, &marker_ids, &marker_coords] { map.marker_update_batch(marker_ids, marker_coords); });
+			}
+			else {
+				//Random markers jitter by up to 20 pixels
+				for (unsigned int _k=0 ; _k != options.moves; _k++) {
+					unsigned int _j = rng() % options.markers;
+					coord2D_t<unsigned int>& coord = markers_coord2D[_j];
+					coord.x = (unsigned int)std::min(std::max((int)coord.x + (int)(rng() % 41) - 20, 0), (int)map.map_size.x - 1);
+					coord.y = (unsigned int)std::min(std::max((int)coord.y + (int)(rng() % 41) - 20, 0), (int)map.map_size.y - 1);
+					update_latency.measure([&map, &pipeline, &coord, _j] { if (pipeline) pipeline->marker_update(_j, coord.x, coord.y); else map.marker_update(_j, coord.x, coord.y); });
+				}
+			}
+			//Deliver the frame of the step
+			if (pipeline) {
+				deliver_latency.measure([&pipeline] { pipeline->flush(); });
+				MapWidgetPipeline::frame_t frame = pipeline->acquire();
+				frames_delivered++;
+				if (!same_image(frame.image(), map.image)) frames_mismatched++;
+			}
+			else {
+				std::vector<cv::Rect> damage = map.take_damage();
+				for (const cv::Rect& area : damage) damaged_pixels += (unsigned long long)area.area();
+				bool published = false;
+				if (exporter) deliver_latency.measure([&exporter, &map, &damage, &published] { published = exporter->publish(map.image, damage); });
+				if (published) {
+					MapFrameReader::frame_t frame;
+					frames_delivered++;
+					if ( (!reader->acquire(frame)) || (!same_image(frame.image, map.image)) || (!reader->validate(frame)) ) frames_mismatched++;
+				}
+			}
+			map_stats_t stats = map.take_stats();
+			total.markers_culled += stats.markers_culled, total.markers_drawn += stats.markers_drawn, total.markers_erased += stats.markers_erased, total.markers_cascaded += stats.markers_cascaded;
+			total.backups += stats.backups, total.backup_pixels += stats.backup_pixels, total.pixels_blitted += stats.pixels_blitted;
+			total.time_background += stats.time_background, total.time_scroll += stats.time_scroll, total.time_cascade += stats.time_cascade, total.time_erase += stats.time_erase, total.time_draw += stats.time_draw;
+		}
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		unsigned long long loop_allocations = allocations - start_allocations, loop_bytes = allocated_bytes - start_bytes, loop_image_buffers = image_buffers - start_image_buffers, loop_image_bytes = image_bytes - start_image_bytes;
+
+		//The tiles are compared with the decoded map over the last window
+		bool tiles_mismatched = false;
+		if (!options.tiles.empty()) {
+			cv::Rect area((map.window_center.x >> map.zoom) - map.window_proj.x, (map.window_center.y >> map.zoom) - map.window_proj.y, map.window_proj.x + map.window_proj.size_x, map.window_proj.y + map.window_proj.size_y);
+			cv::Mat tiled(area.height, area.width, CV_8UC3), decoded(area.height, area.width, CV_8UC3);
+			background->copy_to(map.zoom, area, tiled), MapImageBackground(background_image).copy_to(map.zoom, area, decoded);
+			tiles_mismatched = !same_image(tiled, decoded);
+		}
+
+		//The image checksum tells whether two builds replayed the same frames
+		uint64_t checksum = 1469598103934665603ULL;
+		for (int _r=0 ; _r != map.image.rows; _r++)
+			for (size_t _c=0 ; _c != map.image.cols * map.image.elemSize(); _c++) checksum = (checksum ^ map.image.ptr<unsigned char>(_r)[_c]) * 1099511628211ULL;
+
+		printf("scenario %s  map %dx%d  window %ux%u  markers %u  steps %u  bands %u  incremental %d  solver %d  save-under %d  views %u  zoom %u%s%s%s\n", options.scenario.c_str(), background_image.cols, background_image.rows, options.window_size.x, options.window_size.y, options.markers, options.steps, options.bands, (int)options.incremental, (int)options.solver, (int)options.save_under, options.views, options.zoom, (options.tiles.empty()) ? "" : "  tiles", (options.export_name.empty()) ? "" : "  export", (options.pipeline) ? "  pipeline" : "");
+		printf("%-16s %.3f s  %.1f frames/s\n", "total", seconds, (seconds > 0.) ? options.steps / seconds : 0.);
+		//With the pipeline the calls only queue the commands; the rendering is in the flush() time
+		draw_latency.print((pipeline) ? "enqueue pan" : "draw()");
+		update_latency.print((pipeline) ? "enqueue marker" : (options.scenario == "walk") ? "update_batch()" : "marker_update()");
+		if (pipeline) deliver_latency.print("flush()");
+		if (exporter) deliver_latency.print("publish()");
+		if ( (pipeline) || (exporter) ) printf("%-16s %llu frames  %llu differ from the map image\n", "delivered", frames_delivered, frames_mismatched);
+		if (!pipeline) printf("%-16s %.0f pixels per frame\n", "damage", (double)damaged_pixels / (double)std::max(options.steps, 1u));
+		if (!options.tiles.empty()) printf("%-16s %s\n", "tiles", (tiles_mismatched) ? "differ from the decoded map" : "match the decoded map");
+		printf("%-16s %llu (%.2f per frame, %llu bytes)\n", "allocations", loop_allocations, (double)loop_allocations / (double)std::max(options.steps, 1u), loop_bytes);
+		printf("%-16s %llu (%.2f per frame, %llu bytes)\n", "image buffers", loop_image_buffers, (double)loop_image_buffers / (double)std::max(options.steps, 1u), loop_image_bytes);
+#ifdef MAP_WIDGET_STATS
+		printf("%-16s culled %u  drawn %u  erased %u  cascaded %u  backups %u (%llu pixels)  blitted %llu pixels\n", "markers", total.markers_culled, total.markers_drawn, total.markers_erased, total.markers_cascaded, total.backups, total.backup_pixels, total.pixels_blitted);
+		printf("%-16s background %.0f us  scroll %.0f us  cascade %.0f us  erase %.0f us  draw %.0f us\n", "phases", total.time_background, total.time_scroll, total.time_cascade, total.time_erase, total.time_draw);
+#endif
+		printf("%-16s %016llx\n", "checksum", (unsigned long long)checksum);
+		if ( (frames_mismatched) || (tiles_mismatched) ) return 1;
+	}
+	catch (const char* error) {
+		printf("%s\n", error);
+		return 1;
+	}
+	return 0;
+}
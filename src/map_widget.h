@@ -0,0 +1,1810 @@
+/*
+ * map_widget.h
+ *
+ *  Created on: Dec 10, 2017
+ *      Author: alex
+ */
+
+#ifndef MAP_WIDGET_H_
+#define MAP_WIDGET_H_
+
+#include <opencv2/opencv.hpp>
+#include <opencv2/core/core.hpp>
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+#include <opencv2/highgui/highgui.hpp>
+
+#include <memory>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+#include <map>
+#include <tuple>
+#include <list>
+#include <deque>
+#include <unordered_map>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <cstdio>
+#include <cstdint>
+#include <chrono>
+#include <atomic>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+
+template<typename T>
+struct coord2D_t { T x, y; };
+
+template<typename T>
+struct rect2D_t  { T x, y, size_x, size_y; };
+
+//The render counters of a MapWidget stats frame; they are compiled in with -DMAP_WIDGET_STATS only and stay zero otherwise (frame and markers_visible are always set)
+struct map_stats_t {
+	unsigned long long frame;           //Index of the stats frame (take_stats() calls)
+	unsigned int markers_visible;       //Drawn markers at the end of the frame
+	unsigned int markers_culled;        //Spatial index candidates skipped as out of the window or not fitting the image
+	unsigned int markers_drawn, markers_erased;
+	unsigned int markers_cascaded;      //Markers erased only because they overlap erased ones from above
+	unsigned int backups;               //Background back-ups made by the marker drawing
+	unsigned long long backup_pixels;   //Pixels copied into the back-ups
+	unsigned long long pixels_blitted;  //Pixels written into the output image (background, scroll, markers)
+	double time_background, time_scroll, time_cascade, time_erase, time_draw; //Time spent per phase (microseconds)
+};
+
+#ifdef MAP_WIDGET_STATS
+#define MAP_STATS(...) __VA_ARGS__
+#else
+#define MAP_STATS(...)
+#endif
+
+//This object adds the time of its scope to the counter (microseconds)
+class MapStatsTimer{
+private:
+	double& counter;
+	std::chrono::steady_clock::time_point start;
+public:
+	MapStatsTimer(double& counter) : counter(counter), start(std::chrono::steady_clock::now()) { }
+	~MapStatsTimer() { this->counter += std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - this->start).count(); }
+};
+
+// Returns true if two rectangles (l1, r1) and (l2, r2) overlap
+template<typename T>
+char rect_overlap(const struct rect2D_t<T>& r1, const struct rect2D_t<T>& r2)
+{
+if (r1.size_x < r2.x || r2.size_x < r1.x) return false; // If one rectangle is on left side of other
+if (r1.size_y < r2.y || r2.size_y < r1.y) return false; // If one rectangle is above of other
+return true;
+}
+
+//This function merges overlapping areas of a list into their bounding rectangles until none overlap
+inline void damage_merge(std::vector<cv::Rect>& rects)
+{
+bool merged = true;
+while ( (merged)) {
+	merged = false;
+	for (unsigned int _i=0 ; _i < rects.size(); _i++)
+		for (unsigned int _j=_i+1 ; _j < rects.size(); )
+			if ((rects[_i] & rects[_j]).area()) {
+				rects[_i] |= rects[_j];
+				rects[_j] = rects.back(), rects.pop_back();
+				merged = true;
+			}
+			else _j++;
+}
+}
+
+//This function collapses a list of damaged areas longer than the limit into their bounding rectangle
+inline void damage_collapse(std::vector<cv::Rect>& rects, unsigned int limit)
+{
+if (rects.size() <= limit) return;
+for (unsigned int _i=1 ; _i != rects.size(); _i++) rects[0] |= rects[_i];
+rects.resize(1);
+}
+
+//This object makes a photo marker of a player
+class MapMarkerWidget{
+public:
+	enum ORIENT : unsigned int { ORIENT_NW, ORIENT_NE, ORIENT_SW, ORIENT_SE, ORIENT_LAST };
+	//The immutable images and geometry of a marker; markers with equal features share one instance
+	struct sprite_t {
+		struct span_t { unsigned int begin, end; }; //Columns [begin, end) of a mask row
+		coord2D_t<unsigned int> border;   //Container (photo) board
+		coord2D_t<unsigned int> length;   //Container (photo) holder
+		coord2D_t<unsigned int> offset;   //Container (photo) offset for NW shape
+		coord2D_t<float       > fshape;   //Container fraction shape
+		unsigned char color[3];  //Container color
+		cv::Mat src_pimage, pimage, fimage_mask[ORIENT::ORIENT_LAST]; //Images; src_pimage is kept to pin the source identity
+		rect2D_t<int> frame[ORIENT::ORIENT_LAST]; //The rectangle container
+		std::vector<span_t> fspans[ORIENT::ORIENT_LAST];       //Runs of the fraction masks row by row
+		std::vector<unsigned int> frows[ORIENT::ORIENT_LAST];  //Row r runs are fspans[frows[r]] .. fspans[frows[r+1]-1]
+		cv::Mat fcolor;                                        //A fraction row filled with the color
+		unsigned int fpixels[ORIENT::ORIENT_LAST];             //Pixels covered by the fraction masks
+
+		//This function encodes the fraction mask of the orientation as runs of the covered columns
+		void encode_spans(unsigned int orient) {
+			const cv::Mat& mask = this->fimage_mask[orient];
+			this->frows[orient].assign(1, 0), this->fpixels[orient] = 0;
+			for (int _r=0 ; _r != mask.rows; _r++) {
+				const unsigned char* row = mask.ptr<unsigned char>(_r);
+				for (int _c=0 ; _c != mask.cols; ) {
+					if (!row[_c]) { _c++; continue; }
+					span_t span = { (unsigned int)_c, 0 };
+					while ( (_c != mask.cols) && (row[_c]) ) _c++;
+					span.end = (unsigned int)_c, this->fpixels[orient] += span.end - span.begin;
+					this->fspans[orient].push_back(span);
+				}
+				this->frows[orient].push_back((unsigned int)this->fspans[orient].size());
+			}
+		}
+
+		//This function defines container geometry and renders the images
+		sprite_t(const unsigned char color[3], float fshape_x, float fshape_y, unsigned int border_x, unsigned int border_y, unsigned int length_x, unsigned int length_y, const cv::Mat& src_pimage) {
+	        if ( (fshape_x < 0.)||(fshape_x > 1.)||(fshape_y < 0.)||(fshape_y > 1.)||(!length_x)||(!length_y) ) throw "failure in PhWidget features";
+			this->fshape.x = fshape_x, this->fshape.y = fshape_y, this->border.x = border_x, this->border.y = border_y, this->length.x = length_x + 2*border_x, this->length.y = length_y + 2*border_y;
+			this->offset.x=(unsigned int)std::round((float)this->length.x*this->fshape.x), this->offset.y=(unsigned int)std::round((float)this->length.y*this->fshape.y);
+			this->src_pimage = src_pimage;
+	        //Set integer geometry
+	        this->color[0] = color[0], this->color[1] = color[1], this->color[2] = color[2];
+	        this->pimage = cv::Mat(this->length.y, this->length.x, CV_8UC3, cv::Scalar(this->color[0], this->color[1], this->color[2]));
+	        cv::Mat pimage_content = cv::Mat(this->pimage, cv::Rect(this->border.x, this->border.y, this->length.x - 2*this->border.x, this->length.y - 2*this->border.y) );
+	        cv::resize(this->src_pimage, pimage_content, pimage_content.size(), 0., 0., cv::INTER_CUBIC);
+	        //Compute orientations
+	        float s, c00, c01, c02, c03, c10, c11, c12, c13;
+	        this->fimage_mask[ORIENT::ORIENT_NW] = cv::Mat(this->offset.y + this->length.y, this->offset.x, CV_8UC1, cv::Scalar(0));
+	        s = +(float)(this->offset.y                  - 1)/(float)this->offset.x, c00 = 0., c01 = s, c02 = s / (float)this->offset.x, c03 = -s / (float)(this->offset.x * this->offset.x);
+	        s = +(float)(this->offset.y + this->length.y - 1)/(float)this->offset.x, c10 = 0., c11 = s, c12 = s / (float)this->offset.x, c13 = -s / (float)(this->offset.x * this->offset.x);
+	        for (unsigned int _i=0; _i!=this->offset.x; _i++) {
+	        	unsigned int y0 = this->length.y + this->offset.y - (unsigned int)std::round(c00 + c01*(float)(_i) + c02*(float)(_i*_i) + c03*(float)(_i*_i*_i));
+	            unsigned int y1 = this->length.y + this->offset.y - (unsigned int)std::round(c10 + c11*(float)(_i) + c12*(float)(_i*_i) + c13*(float)(_i*_i*_i));
+	        	do { unsigned char& c = this->fimage_mask[ORIENT::ORIENT_NW].at<unsigned char>(y0-1, _i); c = 1; } while(y1 != y0--);
+	            }
+	        this->frame[ORIENT::ORIENT_NW] = { 0, -(int)(this->length.y + this->offset.y), (int)(this->length.x + this->offset.x), 0 } ;
+	        this->fimage_mask[ORIENT::ORIENT_NE] = cv::Mat(this->offset.y + this->length.y, this->offset.x, CV_8UC1, cv::Scalar(0));
+	        s = -(float)(this->offset.y                  - 1)/(float)this->offset.x, c00 = (float)(this->offset.y),                  c01 = s, c02 = s / (float)this->offset.x, c03 = -s / (float)(this->offset.x * this->offset.x);
+	        s = -(float)(this->offset.y + this->length.y - 1)/(float)this->offset.x, c10 = (float)(this->offset.y + this->length.y), c11 = s, c12 = s / (float)this->offset.x, c13 = -s / (float)(this->offset.x * this->offset.x);
+	        for (unsigned int _i=0; _i!=this->offset.x; _i++) {
+	        	unsigned int y0 = this->length.y + this->offset.y - (unsigned int)std::round(c00 + c01*(float)(_i) + c02*(float)(_i*_i) + c03*(float)(_i*_i*_i));
+	            unsigned int y1 = this->length.y + this->offset.y - (unsigned int)std::round(c10 + c11*(float)(_i) + c12*(float)(_i*_i) + c13*(float)(_i*_i*_i));
+	        	do { unsigned char& c = this->fimage_mask[ORIENT::ORIENT_NE].at<unsigned char>(y0-1, _i); c = 1; } while(y1 != y0--);
+	            }
+	        this->frame[ORIENT::ORIENT_NE] = { -(int)(this->length.x + this->offset.x), -(int)(this->length.y + this->offset.y), 0, 0 } ;
+	        this->fimage_mask[ORIENT::ORIENT_SW] = cv::Mat(this->offset.y + this->length.y, this->offset.x, CV_8UC1, cv::Scalar(0));
+	        s = -(float)(this->offset.y + this->length.y - 1)/(float)this->offset.x, c00 = (float)(this->offset.y + this->length.y), c01 = s, c02 = s / (float)this->offset.x, c03 = -s / (float)(this->offset.x * this->offset.x);
+	        s = -(float)(this->offset.y                  - 1)/(float)this->offset.x, c10 = (float)(this->offset.y + this->length.y), c11 = s, c12 = s / (float)this->offset.x, c13 = -s / (float)(this->offset.x * this->offset.x);
+	        for (unsigned int _i=0; _i!=this->offset.x; _i++) {
+	        	unsigned int y0 = this->length.y + this->offset.y - (unsigned int)std::round(c00 + c01*(float)(_i) + c02*(float)(_i*_i) + c03*(float)(_i*_i*_i));
+	            unsigned int y1 = this->length.y + this->offset.y - (unsigned int)std::round(c10 + c11*(float)(_i) + c12*(float)(_i*_i) + c13*(float)(_i*_i*_i));
+	        	do { unsigned char& c = this->fimage_mask[ORIENT::ORIENT_SW].at<unsigned char>(y0-1, _i); c = 1; } while(y1 != y0--);
+	            }
+	        this->frame[ORIENT::ORIENT_SW] = { 0, 0, +(int)(this->length.x + this->offset.x), +(int)(this->length.y + this->offset.y) } ;
+	        this->fimage_mask[ORIENT::ORIENT_SE] = cv::Mat(this->offset.y + this->length.y, this->offset.x, CV_8UC1, cv::Scalar(0));
+	        s = +(float)(this->offset.y + this->length.y - 1)/(float)this->offset.x, c00 = 0.,                    c01 = s, c02 = s / (float)this->offset.x, c03 = -s / (float)(this->offset.x * this->offset.x);
+	        s = +(float)(this->offset.y                  - 1)/(float)this->offset.x, c10 = (float)this->length.y, c11 = s, c12 = s / (float)this->offset.x, c13 = -s / (float)(this->offset.x * this->offset.x);
+	        for (unsigned int _i=0; _i!=this->offset.x; _i++) {
+	        	unsigned int y0 = this->length.y + this->offset.y - (unsigned int)std::round(c00 + c01*(float)(_i) + c02*(float)(_i*_i) + c03*(float)(_i*_i*_i));
+	            unsigned int y1 = this->length.y + this->offset.y - (unsigned int)std::round(c10 + c11*(float)(_i) + c12*(float)(_i*_i) + c13*(float)(_i*_i*_i));
+	        	do { unsigned char& c = this->fimage_mask[ORIENT::ORIENT_SE].at<unsigned char>(y0-1, _i); c = 1; } while(y1 != y0--);
+	            }
+	        this->frame[ORIENT::ORIENT_SE] = { -(int)(this->length.x + this->offset.x), 0, 0, +(int)(this->length.y + this->offset.y) } ;
+	        //Encode the masks for the blitting
+	        for (unsigned int _o=0 ; _o != ORIENT::ORIENT_LAST; _o++) this->encode_spans(_o);
+	        this->fcolor = cv::Mat(1, this->offset.x, CV_8UC3, cv::Scalar(this->color[0], this->color[1], this->color[2]));
+		}
+	};
+
+    unsigned int default_orient;
+    const unsigned int& drawn_orient; //It equals -1 if the marker was not drawn
+    const rect2D_t<int>& drawn_frame;
+    const unsigned int& orient_hint; //It equals -1 if there is no hint
+private:
+    unsigned int _drawn_orient;
+    unsigned int _orient_hint; //The orientation preferred over default_orient while it fits the image
+	std::shared_ptr<const sprite_t> sprite; //Shared images and geometry
+	coord2D_t<unsigned int> origin;   //Container origin
+	cv::Mat back_pimage, back_fimage; //Background back-up images
+	bool save_under;                  //Back up the background under the drawn widget; the buffers are allocated on its first drawing
+    rect2D_t<int> _drawn_frame; //The drawn rectangle container
+
+	//This function backs up (if there is a save-under buffer) and fills the covered pixels of the fraction area; the area is in the mask coordinates
+	void fraction_draw(cv::Mat& ffragment, unsigned int orient, const cv::Rect& area) {
+		const std::vector<sprite_t::span_t>& spans = this->sprite->fspans[orient];
+		const std::vector<unsigned int>& rows = this->sprite->frows[orient];
+		const unsigned char* color = this->sprite->fcolor.ptr<unsigned char>(0);
+		size_t pixel = ffragment.elemSize();
+		bool back_up = !this->back_fimage.empty();
+		for (int _r=area.y ; _r != area.y + area.height; _r++) {
+			unsigned char *dst = ffragment.ptr<unsigned char>(_r), *back = (back_up) ? this->back_fimage.ptr<unsigned char>(_r) : nullptr;
+			for (unsigned int _s=rows[_r] ; _s != rows[_r+1]; _s++) {
+				int span_begin = std::max((int)spans[_s].begin, area.x), span_end = std::min((int)spans[_s].end, area.x + area.width);
+				if (span_begin >= span_end) continue;
+				size_t begin = pixel*span_begin, bytes = pixel*(span_end - span_begin);
+				if (back_up) std::memcpy(back + begin, dst + begin, bytes);
+				std::memcpy(dst + begin, color, bytes);
+			}
+		}
+	}
+
+	//This function restores the covered pixels of the fraction from the back-up
+	void fraction_erase(cv::Mat& ffragment, unsigned int orient) {
+		const std::vector<sprite_t::span_t>& spans = this->sprite->fspans[orient];
+		const std::vector<unsigned int>& rows = this->sprite->frows[orient];
+		size_t pixel = ffragment.elemSize();
+		for (int _r=0 ; _r != ffragment.rows; _r++) {
+			unsigned char *dst = ffragment.ptr<unsigned char>(_r);
+			const unsigned char *back = this->back_fimage.ptr<unsigned char>(_r);
+			for (unsigned int _s=rows[_r] ; _s != rows[_r+1]; _s++) {
+				size_t begin = pixel*spans[_s].begin;
+				std::memcpy(dst + begin, back + begin, pixel*(spans[_s].end - spans[_s].begin));
+			}
+		}
+	}
+
+	//This function allocates the save-under buffers of a widget about to be drawn
+	void save_under_alloc(void) {
+		if ( (!this->save_under) || (!this->back_pimage.empty()) ) return;
+		this->back_pimage = cv::Mat(this->sprite->length.y,                        this->sprite->length.x, CV_8UC3);
+		this->back_fimage = cv::Mat(this->sprite->length.y+this->sprite->offset.y, this->sprite->offset.x, CV_8UC3);
+	}
+
+	//This function change widget orientation as it is required by image borders; when in doubt it uses cw orientation rule
+	unsigned int forced_drawn_orient(const coord2D_t<unsigned int>& origin, const cv::Mat& background_image) const {
+		coord2D_t<unsigned int> size = { .x = this->sprite->offset.x + this->sprite->length.x, .y = this->sprite->offset.y + this->sprite->length.y };
+		if (origin.x >= size.x) {
+			if ((int)(origin.x + size.x) <= background_image.cols) {
+            	if (origin.y >= size.y) {
+        			if ((int)(origin.y + size.y) <= background_image.rows) return (unsigned int)-1; //No limitations
+                	else return ( (this->default_orient == ORIENT::ORIENT_NE) || (this->default_orient == ORIENT::ORIENT_NW) ) ? (unsigned int)-1 : ORIENT::ORIENT_NW; //Bottom-most side
+            	}
+            	else return ( (this->default_orient == ORIENT::ORIENT_SE) || (this->default_orient == ORIENT::ORIENT_SW) ) ? (unsigned int)-1 : ORIENT::ORIENT_SE; //Top-most side
+			}
+			else {//Right-most size
+            	if (origin.y >= size.y) {
+        			if ((int)(origin.y + size.y) <= background_image.rows) return (this->default_orient == ORIENT::ORIENT_SE) || (this->default_orient == ORIENT::ORIENT_NE) ? (unsigned int)-1 : ORIENT::ORIENT_SE; //Right-most side
+        			else return (this->default_orient == ORIENT::ORIENT_NE) ? (unsigned int)-1 : ORIENT::ORIENT_NE; // Right-bottom corner
+            	}
+            	else return (this->default_orient == ORIENT::ORIENT_SE) ? (unsigned int)-1 : ORIENT::ORIENT_SE; //Right-top corner
+			}
+		}
+	    else { //Left-most size
+        	if (origin.y >= size.y) {
+    			if ((int)(origin.y + size.y) <= background_image.rows) return (this->default_orient == ORIENT::ORIENT_SW) || (this->default_orient == ORIENT::ORIENT_NW) ? (unsigned int)-1 : ORIENT::ORIENT_NW; //Left-most side
+    			else return (this->default_orient == ORIENT::ORIENT_NW) ? (unsigned int)-1 : ORIENT::ORIENT_NW; // Left-bottom corner
+        	}
+        	else return (this->default_orient == ORIENT::ORIENT_SW) ? (unsigned int)-1 : ORIENT::ORIENT_SW; //Left-top corner
+		}
+	}
+
+public:
+	//This function defines container geometry
+	MapMarkerWidget(unsigned char color[3], float fshape_x, float fshape_y, unsigned int border_x, unsigned int border_y, unsigned int length_x, unsigned int length_y, const cv::Mat& src_pimage) :
+		MapMarkerWidget(std::make_shared<const sprite_t>(color, fshape_x, fshape_y, border_x, border_y, length_x, length_y, src_pimage)) { }
+
+	//This function makes a container over a shared sprite
+	MapMarkerWidget(std::shared_ptr<const sprite_t> sprite) :
+		drawn_orient(this->_drawn_orient),
+        drawn_frame(this->_drawn_frame),
+        orient_hint(this->_orient_hint),
+        sprite(sprite) {
+		this->default_orient = ORIENT::ORIENT_NW, this->origin.x = 0, this->origin.y = this->sprite->offset.y + this->sprite->length.y;
+        this->set_save_under(true);
+        //Init drawn
+        this->_drawn_orient = (unsigned int)-1, this->_orient_hint = (unsigned int)-1;
+	}
+
+    //This function returns the pixels the drawing (or the erasing) of the drawn widget copies
+	unsigned int pixels(void) const { return (this->_drawn_orient == (unsigned int)-1) ? 0 : this->sprite->length.x * this->sprite->length.y + this->sprite->fpixels[this->_drawn_orient]; }
+
+    //This function returns the widget extent around its origin for any orientation
+	coord2D_t<unsigned int> reach(void) const { return { this->sprite->offset.x + this->sprite->length.x, this->sprite->offset.y + this->sprite->length.y }; }
+
+    //This function changes orientation of the widget
+	void set_default_orient(unsigned int default_orient) { if (default_orient < ORIENT::ORIENT_LAST) this->default_orient = default_orient; }
+
+	//This function sets the orientation preferred over the default one while it fits the image (e.g. by an overlap solver); -1 removes the hint
+	void set_orient_hint(unsigned int orient_hint) { this->_orient_hint = (orient_hint < ORIENT::ORIENT_LAST) ? orient_hint : (unsigned int)-1; }
+
+	//This function define container origin
+	void set_origin(unsigned int x,unsigned int y) { this->origin.x = x, this->origin.y = y; }
+
+	//This function returns the container rectangle of the orientation at the origin
+	rect2D_t<int> frame_at(unsigned int orient, const coord2D_t<unsigned int>& origin) const {
+		return { (int)origin.x + this->sprite->frame[orient].x, (int)origin.y + this->sprite->frame[orient].y, (int)origin.x + this->sprite->frame[orient].size_x, (int)origin.y + this->sprite->frame[orient].size_y };
+	}
+
+	//This function returns true if the container of the orientation at the origin lies inside the image
+	bool fits(unsigned int orient, const coord2D_t<unsigned int>& origin, const cv::Mat& background_image) const {
+		rect2D_t<int> frame = this->frame_at(orient, origin);
+		return (frame.x >= 0) && (frame.y >= 0) && (frame.size_x <= background_image.cols) && (frame.size_y <= background_image.rows);
+	}
+
+	//This function returns the orientation the widget would be drawn with at the origin; it returns -1 if the widget does not fit
+	unsigned int orient_at(const coord2D_t<unsigned int>& origin, const cv::Mat& background_image) const {
+		unsigned int orient;
+		if ( ((int)origin.x < background_image.cols) && ((int)(this->sprite->offset.x + this->sprite->length.x) <= background_image.cols) && ((int)origin.y < background_image.rows) && ((int)(this->sprite->offset.y + this->sprite->length.y) <= background_image.rows)) {
+			if ( (this->_orient_hint != (unsigned int)-1) && (this->fits(this->_orient_hint, origin, background_image)) ) return this->_orient_hint;
+			if ((orient = this->forced_drawn_orient(origin, background_image)) == (unsigned int)-1) orient = (unsigned int) this->default_orient;
+			return orient;
+		}
+		return (unsigned int)-1;
+	}
+
+	//This function moves the drawn widget together with the scrolled image without redrawing it
+	void shift(int dx, int dy) {
+		this->origin.x += dx, this->origin.y += dy;
+		this->_drawn_frame.x += dx, this->_drawn_frame.y += dy, this->_drawn_frame.size_x += dx, this->_drawn_frame.size_y += dy;
+	}
+
+	//This is the main function of the container
+	void draw(cv::Mat& background_image) {
+		unsigned int orient;
+		if ((orient = this->orient_at(this->origin, background_image)) != (unsigned int)-1) {
+			this->save_under_alloc();
+			switch (orient){
+				case ORIENT::ORIENT_NW : {
+					cv::Mat pfragment(background_image,cv::Rect(this->origin.x + this->sprite->offset.x, this->origin.y - this->sprite->offset.y - this->sprite->length.y, this->sprite->length.x,                  this->sprite->length.y) );
+					cv::Mat ffragment(background_image,cv::Rect(this->origin.x,                  this->origin.y - this->sprite->offset.y - this->sprite->length.y, this->sprite->offset.x, this->sprite->offset.y + this->sprite->length.y) );
+					if (!this->back_pimage.empty()) pfragment.copyTo(this->back_pimage); //Back-up the background
+					this->fraction_draw(ffragment, ORIENT::ORIENT_NW, cv::Rect(0, 0, ffragment.cols, ffragment.rows)), this->sprite->pimage.copyTo(pfragment); //Draw
+				break; }
+				case ORIENT::ORIENT_NE : {
+					cv::Mat pfragment(background_image,cv::Rect(this->origin.x - this->sprite->offset.x - this->sprite->length.x, this->origin.y - this->sprite->offset.y - this->sprite->length.y, this->sprite->length.x,                  this->sprite->length.y) );
+					cv::Mat ffragment(background_image,cv::Rect(this->origin.x - this->sprite->offset.x,                  this->origin.y - this->sprite->offset.y - this->sprite->length.y, this->sprite->offset.x, this->sprite->offset.y + this->sprite->length.y) );
+					if (!this->back_pimage.empty()) pfragment.copyTo(this->back_pimage); //Back-up the background
+					this->fraction_draw(ffragment, ORIENT::ORIENT_NE, cv::Rect(0, 0, ffragment.cols, ffragment.rows)), this->sprite->pimage.copyTo(pfragment); //Draw
+				break; }
+				case ORIENT::ORIENT_SW : {
+					cv::Mat pfragment(background_image,cv::Rect(this->origin.x + this->sprite->offset.x, this->origin.y + this->sprite->offset.y, this->sprite->length.x,                  this->sprite->length.y) );
+					cv::Mat ffragment(background_image,cv::Rect(this->origin.x,                  this->origin.y                 , this->sprite->offset.x, this->sprite->offset.y + this->sprite->length.y) );
+					if (!this->back_pimage.empty()) pfragment.copyTo(this->back_pimage); //Back-up the background
+					this->fraction_draw(ffragment, ORIENT::ORIENT_SW, cv::Rect(0, 0, ffragment.cols, ffragment.rows)), this->sprite->pimage.copyTo(pfragment); //Draw
+				break; }
+				case ORIENT::ORIENT_SE : {
+					cv::Mat pfragment(background_image,cv::Rect(this->origin.x - this->sprite->offset.x - this->sprite->length.x, this->origin.y + this->sprite->offset.y, this->sprite->length.x,                  this->sprite->length.y) );
+					cv::Mat ffragment(background_image,cv::Rect(this->origin.x - this->sprite->offset.x,                  this->origin.y                 , this->sprite->offset.x, this->sprite->offset.y + this->sprite->length.y) );
+					if (!this->back_pimage.empty()) pfragment.copyTo(this->back_pimage); //Back-up the background
+					this->fraction_draw(ffragment, ORIENT::ORIENT_SE, cv::Rect(0, 0, ffragment.cols, ffragment.rows)), this->sprite->pimage.copyTo(pfragment); //Draw
+				break; }
+				default                : throw("FAILED to draw unknown orientation of MapMarkerWidget");
+			}
+		this->_drawn_orient = orient;
+		this->_drawn_frame.x = (int)this->origin.x + this->sprite->frame[orient].x, this->_drawn_frame.y = (int)this->origin.y + this->sprite->frame[orient].y, this->_drawn_frame.size_x = (int)this->origin.x + this->sprite->frame[orient].size_x, this->_drawn_frame.size_y = (int)this->origin.y + this->sprite->frame[orient].size_y;
+		}
+	}
+	//This function returns the output image rectangles of the container photo and fraction for the orientation
+	void fragments(unsigned int orient, cv::Rect& prect, cv::Rect& frect) const {
+		switch (orient){
+			case ORIENT::ORIENT_NW : prect = cv::Rect(this->origin.x + this->sprite->offset.x,                  this->origin.y - this->sprite->offset.y - this->sprite->length.y, this->sprite->length.x, this->sprite->length.y), frect = cv::Rect(this->origin.x,                  this->origin.y - this->sprite->offset.y - this->sprite->length.y, this->sprite->offset.x, this->sprite->offset.y + this->sprite->length.y); break;
+			case ORIENT::ORIENT_NE : prect = cv::Rect(this->origin.x - this->sprite->offset.x - this->sprite->length.x, this->origin.y - this->sprite->offset.y - this->sprite->length.y, this->sprite->length.x, this->sprite->length.y), frect = cv::Rect(this->origin.x - this->sprite->offset.x, this->origin.y - this->sprite->offset.y - this->sprite->length.y, this->sprite->offset.x, this->sprite->offset.y + this->sprite->length.y); break;
+			case ORIENT::ORIENT_SW : prect = cv::Rect(this->origin.x + this->sprite->offset.x,                  this->origin.y + this->sprite->offset.y,                          this->sprite->length.x, this->sprite->length.y), frect = cv::Rect(this->origin.x,                  this->origin.y,                                                    this->sprite->offset.x, this->sprite->offset.y + this->sprite->length.y); break;
+			case ORIENT::ORIENT_SE : prect = cv::Rect(this->origin.x - this->sprite->offset.x - this->sprite->length.x, this->origin.y + this->sprite->offset.y,                          this->sprite->length.x, this->sprite->length.y), frect = cv::Rect(this->origin.x - this->sprite->offset.x, this->origin.y,                                                    this->sprite->offset.x, this->sprite->offset.y + this->sprite->length.y); break;
+			default                : throw("FAILED to locate unknown orientation of MapMarkerWidget");
+		}
+	}
+
+	//This function marks the widget drawn as draw() would do without touching the image; the pixels are put by render(). It returns the orientation.
+	//The save-under buffers are allocated here, so render() may run in parallel
+	unsigned int place(const cv::Mat& background_image) {
+		unsigned int orient;
+		if ((orient = this->orient_at(this->origin, background_image)) != (unsigned int)-1) {
+			this->save_under_alloc();
+			this->_drawn_orient = orient;
+			this->_drawn_frame.x = (int)this->origin.x + this->sprite->frame[orient].x, this->_drawn_frame.y = (int)this->origin.y + this->sprite->frame[orient].y, this->_drawn_frame.size_x = (int)this->origin.x + this->sprite->frame[orient].size_x, this->_drawn_frame.size_y = (int)this->origin.y + this->sprite->frame[orient].size_y;
+		}
+		return orient;
+	}
+
+	//This function backs up (if there are save-under buffers) and draws the part of the placed widget inside the clip rectangle;
+	//the pixels of the image and of the back-up images inside the clip rectangle are touched only
+	void render(cv::Mat& background_image, const cv::Rect& clip) {
+		if ( (this->_drawn_orient == (unsigned int)-1) || (clip.y >= this->_drawn_frame.size_y) || (clip.y + clip.height <= this->_drawn_frame.y) || (clip.x >= this->_drawn_frame.size_x) || (clip.x + clip.width <= this->_drawn_frame.x) ) return;
+		cv::Rect prect, frect;
+		this->fragments(this->_drawn_orient, prect, frect);
+		cv::Rect area = frect & clip;
+		if (area.area()) {
+			cv::Mat ffragment(background_image, frect);
+			this->fraction_draw(ffragment, this->_drawn_orient, cv::Rect(area.x - frect.x, area.y - frect.y, area.width, area.height));
+		}
+		area = prect & clip;
+		if (area.area()) {
+			cv::Rect part(area.x - prect.x, area.y - prect.y, area.width, area.height);
+			cv::Mat pfragment(background_image, area);
+			if (!this->back_pimage.empty()) {
+				cv::Mat back_pfragment(this->back_pimage, part);
+				pfragment.copyTo(back_pfragment);
+			}
+			cv::Mat(this->sprite->pimage, part).copyTo(pfragment);
+		}
+	}
+
+	//This function turns on/off the save-under buffers; they are allocated on the next drawing. Without them erase() is not possible and
+	//the owner recomposes the image instead
+	void set_save_under(bool save_under) {
+		this->save_under = save_under;
+		if (!save_under) this->back_pimage.release(), this->back_fimage.release();
+	}
+
+	//This function frees the save-under buffers of a widget which is not drawn (e.g. it left the window); the next drawing allocates them again
+	void release_save_under(void) { if (this->_drawn_orient == (unsigned int)-1) this->back_pimage.release(), this->back_fimage.release(); }
+
+	//This method reset the widget drawn flag to -1
+	void reset_drawn_orient_flag(void) { this->_drawn_orient = (unsigned int)-1; }
+    //This function undo the drawing
+	void erase(cv::Mat& background_image) {
+		if ( (this->_drawn_orient != (unsigned int)-1)) {
+			if (this->back_pimage.empty()) throw("MapMarkerWidget has no save-under buffers to erase");
+            switch (this->_drawn_orient){
+				case ORIENT::ORIENT_NW : {
+					cv::Mat ffragment(background_image,cv::Rect(this->origin.x,                  this->origin.y - this->sprite->offset.y - this->sprite->length.y, this->sprite->offset.x, this->sprite->offset.y + this->sprite->length.y) );
+					cv::Mat pfragment(background_image,cv::Rect(this->origin.x + this->sprite->offset.x, this->origin.y - this->sprite->offset.y - this->sprite->length.y, this->sprite->length.x,                  this->sprite->length.y) );
+					this->fraction_erase(ffragment, this->_drawn_orient), this->back_pimage.copyTo(pfragment);
+				break; }
+				case ORIENT::ORIENT_NE : {
+					cv::Mat ffragment(background_image,cv::Rect(this->origin.x - this->sprite->offset.x,                  this->origin.y - this->sprite->offset.y - this->sprite->length.y, this->sprite->offset.x, this->sprite->offset.y + this->sprite->length.y) );
+					cv::Mat pfragment(background_image,cv::Rect(this->origin.x - this->sprite->offset.x - this->sprite->length.x, this->origin.y - this->sprite->offset.y - this->sprite->length.y, this->sprite->length.x,                  this->sprite->length.y) );
+					this->fraction_erase(ffragment, this->_drawn_orient), this->back_pimage.copyTo(pfragment);
+				break; }
+				case ORIENT::ORIENT_SW : {
+					cv::Mat pfragment(background_image,cv::Rect(this->origin.x + this->sprite->offset.x, this->origin.y + this->sprite->offset.y, this->sprite->length.x,                  this->sprite->length.y) );
+					cv::Mat ffragment(background_image,cv::Rect(this->origin.x,                  this->origin.y                 , this->sprite->offset.x, this->sprite->offset.y + this->sprite->length.y) );
+					this->fraction_erase(ffragment, this->_drawn_orient), this->back_pimage.copyTo(pfragment);
+				break; }
+				case ORIENT::ORIENT_SE : {
+					cv::Mat pfragment(background_image,cv::Rect(this->origin.x - this->sprite->offset.x - this->sprite->length.x, this->origin.y + this->sprite->offset.y, this->sprite->length.x,                  this->sprite->length.y) );
+					cv::Mat ffragment(background_image,cv::Rect(this->origin.x - this->sprite->offset.x,                  this->origin.y                 , this->sprite->offset.x, this->sprite->offset.y + this->sprite->length.y) );
+					this->fraction_erase(ffragment, this->_drawn_orient), this->back_pimage.copyTo(pfragment);
+				break; }
+				default                : throw("FAILED to erase unknown orientation of MapMarkerWidget");
+			}
+		  this->_drawn_orient = (unsigned int)-1;
+		}
+	}
+
+};
+
+//This object is a uniform grid spatial index over marker map coordinates
+class MapMarkerGrid{
+private:
+	unsigned int cell;                            //Grid cell size (pixels)
+	coord2D_t<unsigned int> size;                 //Grid size (cells)
+	std::vector<std::vector<unsigned int>> cells; //Marker ids per cell (row-major)
+
+	//This function clamps a map coordinate into the cell range
+	unsigned int cell_x(int x) const { return (x < 0) ? 0 : ( ((unsigned int)x/this->cell < this->size.x) ? (unsigned int)x/this->cell : this->size.x - 1 ); }
+	unsigned int cell_y(int y) const { return (y < 0) ? 0 : ( ((unsigned int)y/this->cell < this->size.y) ? (unsigned int)y/this->cell : this->size.y - 1 ); }
+public:
+	//The constructor
+	MapMarkerGrid(unsigned int map_size_x, unsigned int map_size_y, unsigned int cell) {
+		if (!cell) throw("Zero grid cell size requested");
+		this->cell = cell, this->size.x = (map_size_x + cell - 1)/cell, this->size.y = (map_size_y + cell - 1)/cell;
+		if (!this->size.x) this->size.x = 1;
+		if (!this->size.y) this->size.y = 1;
+		this->cells.resize(this->size.x * this->size.y);
+	}
+
+	//This function registers a marker at the map point
+	void insert(unsigned int marker_id, const coord2D_t<unsigned int>& coord) {
+		this->cells[this->cell_y((int)coord.y) * this->size.x + this->cell_x((int)coord.x)].push_back(marker_id);
+	}
+
+	//This function unregisters a marker from the map point
+	void remove(unsigned int marker_id, const coord2D_t<unsigned int>& coord) {
+		std::vector<unsigned int>& ids = this->cells[this->cell_y((int)coord.y) * this->size.x + this->cell_x((int)coord.x)];
+		for (unsigned int _i=0 ; _i != ids.size(); _i++)
+			if (ids[_i] == marker_id) { ids[_i] = ids.back(), ids.pop_back(); break; }
+	}
+
+	//This function moves a marker between map points; it only touches the index if the cell changes
+	void move(unsigned int marker_id, const coord2D_t<unsigned int>& from, const coord2D_t<unsigned int>& to) {
+		if ( (this->cell_x((int)from.x) != this->cell_x((int)to.x)) || (this->cell_y((int)from.y) != this->cell_y((int)to.y)) ) this->remove(marker_id, from), this->insert(marker_id, to);
+	}
+
+	//This function calls f(marker_id) for every marker in cells touching the map area [x, size_x) x [y, size_y); callers do exact filtering
+	template<typename F>
+	void query(const rect2D_t<int>& area, F f) const {
+		if ( (area.size_x <= area.x) || (area.size_y <= area.y) ) return;
+		unsigned int x0 = this->cell_x(area.x), x1 = this->cell_x(area.size_x - 1), y0 = this->cell_y(area.y), y1 = this->cell_y(area.size_y - 1);
+		for (unsigned int _y=y0 ; _y <= y1; _y++)
+			for (unsigned int _x=x0 ; _x <= x1; _x++)
+				for (unsigned int marker_id : this->cells[_y * this->size.x + _x]) f(marker_id);
+	}
+};
+
+//This object is a source of the background map image
+class MapBackground{
+protected:
+	coord2D_t<unsigned int> _size;  //Map size
+public:
+	const coord2D_t<unsigned int>& size; //Read-only map size
+
+	MapBackground(void) : size(this->_size) { this->_size.x = 0, this->_size.y = 0; }
+	virtual ~MapBackground() { }
+
+	//This function returns the map size at the zoom level; each level halves the previous one (rounding up)
+	coord2D_t<unsigned int> level_size(unsigned int level) const { return { ((this->_size.x - 1) >> level) + 1, ((this->_size.y - 1) >> level) + 1 }; }
+
+	//This function halves the image of a zoom level into the next one: each pixel averages its 2x2 block, the last odd row and column
+	//average the pixels they have. Blocks never straddle the even tile borders, so tiles and whole images give the same levels
+	static void level_downsample(const cv::Mat& src, cv::Mat& dst) {
+		cv::Mat padded;
+		cv::copyMakeBorder(src, padded, 0, src.rows & 1, 0, src.cols & 1, cv::BORDER_REPLICATE);
+		cv::resize(padded, dst, cv::Size(padded.cols/2, padded.rows/2), 0., 0., cv::INTER_AREA);
+	}
+
+	//This function returns the number of zoom levels; the last one is a single pixel
+	unsigned int levels(void) const {
+		unsigned int level = 0;
+		while ( ((this->_size.x - 1) >> level) || ((this->_size.y - 1) >> level) ) level++;
+		return level + 1;
+	}
+
+	//This function copies the map area of the zoom level into the destination image of the same size
+	virtual void copy_to(unsigned int level, const cv::Rect& area, cv::Mat& dst) = 0;
+
+	//This function hints the upcoming map area to the source: area is the current one at the zoom level and (dx, dy) is the last pan
+	virtual void prefetch(unsigned int level, const cv::Rect& area, int dx, int dy) { }
+};
+
+//This object is a background map kept as one decoded image; zoom levels are built lazily on the first use
+class MapImageBackground : public MapBackground{
+private:
+	std::vector<cv::Mat> pyramid; //pyramid[0] is the image
+	std::mutex mutex;
+
+	//This function returns the image of the zoom level building the missing levels
+	cv::Mat level_image(unsigned int level) {
+		std::lock_guard<std::mutex> lock(this->mutex);
+		while (this->pyramid.size() <= level) {
+			cv::Mat image;
+			MapBackground::level_downsample(this->pyramid.back(), image);
+			this->pyramid.push_back(image);
+		}
+		return this->pyramid[level];
+	}
+public:
+	MapImageBackground(const cv::Mat& image) {
+		if (image.type() != CV_8UC3) throw("Unsupported background image type");
+		this->_size.x = image.cols, this->_size.y = image.rows, this->pyramid.push_back(image);
+	}
+
+	void copy_to(unsigned int level, const cv::Rect& area, cv::Mat& dst) override { cv::Mat(this->level_image(level), area).copyTo(dst); }
+};
+
+//This object loads single tiles of a pre-cut map
+class MapTileSource{
+protected:
+	coord2D_t<unsigned int> _size;  //Map size
+	unsigned int _tile;             //Tile size; edge tiles may be smaller
+public:
+	const coord2D_t<unsigned int>& size; //Read-only map size
+	const unsigned int& tile;            //Read-only tile size
+
+	MapTileSource(unsigned int size_x, unsigned int size_y, unsigned int tile) : size(this->_size), tile(this->_tile) {
+		if ( (!size_x) || (!size_y) || (!tile) ) throw("Incorrect tiled map geometry");
+		this->_size.x = size_x, this->_size.y = size_y, this->_tile = tile;
+	}
+	virtual ~MapTileSource() { }
+
+	//This function loads the tile (tx, ty); it returns an empty image on failure. It may be called from the prefetch thread
+	virtual cv::Mat load(unsigned int tx, unsigned int ty) = 0;
+};
+
+//This object loads tiles from a directory of "<ty>_<tx><ext>" image files
+class MapTileDirSource : public MapTileSource{
+private:
+	std::string dir, ext;
+public:
+	MapTileDirSource(const std::string& dir, unsigned int size_x, unsigned int size_y, unsigned int tile, const std::string& ext = ".png") :
+		MapTileSource(size_x, size_y, tile), dir(dir), ext(ext) { }
+
+	cv::Mat load(unsigned int tx, unsigned int ty) override {
+		return cv::imread(this->dir + "/" + std::to_string(ty) + "_" + std::to_string(tx) + this->ext, CV_LOAD_IMAGE_COLOR);
+	}
+
+	//This function cuts the image into the (existing) tile directory
+	static void write(const std::string& dir, const cv::Mat& image, unsigned int tile, const std::string& ext = ".png") {
+		for (unsigned int _ty=0 ; _ty*tile < (unsigned int)image.rows; _ty++)
+			for (unsigned int _tx=0 ; _tx*tile < (unsigned int)image.cols; _tx++)
+				if (!cv::imwrite(dir + "/" + std::to_string(_ty) + "_" + std::to_string(_tx) + ext, cv::Mat(image, cv::Rect(_tx*tile, _ty*tile, std::min(tile, image.cols - _tx*tile), std::min(tile, image.rows - _ty*tile)))))
+					throw("Failed to write a map tile");
+	}
+};
+
+//This object maps a raw tile file: a header followed by BGR tiles of full size (edge tiles padded) in row-major order
+class MapRawTileSource : public MapTileSource{
+public:
+	struct header_t { char magic[8]; uint32_t size_x, size_y, tile, channels; };
+private:
+	unsigned char* data;  //The mapping
+	size_t data_size;
+	coord2D_t<unsigned int> tiles;  //Tile grid size
+
+	//This function reads the header of the file
+	static header_t read_header(const std::string& path) {
+		header_t header;
+		FILE* file = fopen(path.c_str(), "rb");
+		if (!file) throw("Failed to open a raw tile file");
+		size_t read = fread(&header, sizeof(header_t), 1, file);
+		fclose(file);
+		if ( (read != 1) || (std::memcmp(header.magic, "MAPTILES", 8)) || (header.channels != 3) ) throw("Incorrect raw tile file");
+		return header;
+	}
+	MapRawTileSource(const std::string& path, const header_t& header) : MapTileSource(header.size_x, header.size_y, header.tile) {
+		this->tiles.x = (this->_size.x + this->_tile - 1)/this->_tile, this->tiles.y = (this->_size.y + this->_tile - 1)/this->_tile;
+		this->data_size = sizeof(header_t) + (size_t)this->tiles.x * this->tiles.y * this->_tile * this->_tile * 3;
+		int fd = open(path.c_str(), O_RDONLY);
+		struct stat st;
+		if ( (fd < 0) || (fstat(fd, &st)) || ((size_t)st.st_size < this->data_size) ) { if (fd >= 0) close(fd); throw("Truncated raw tile file"); }
+		void* mapping = mmap(nullptr, this->data_size, PROT_READ, MAP_SHARED, fd, 0);
+		close(fd);
+		if (mapping == MAP_FAILED) throw("Failed to map a raw tile file");
+		this->data = (unsigned char*)mapping;
+	}
+public:
+	MapRawTileSource(const std::string& path) : MapRawTileSource(path, MapRawTileSource::read_header(path)) { }
+	~MapRawTileSource() { munmap(this->data, this->data_size); }
+
+	//The tile is not copied; the page-in of its range is requested ahead
+	cv::Mat load(unsigned int tx, unsigned int ty) override {
+		if ( (tx >= this->tiles.x) || (ty >= this->tiles.y) ) return cv::Mat();
+		size_t tile_bytes = (size_t)this->_tile * this->_tile * 3, page = (size_t)sysconf(_SC_PAGESIZE);
+		unsigned char* ptile = this->data + sizeof(header_t) + ((size_t)ty * this->tiles.x + tx) * tile_bytes;
+		unsigned char* ppage = this->data + ((size_t)(ptile - this->data) / page) * page;
+		madvise(ppage, (size_t)(ptile - ppage) + tile_bytes, MADV_WILLNEED);
+		return cv::Mat(std::min(this->_tile, this->_size.y - ty*this->_tile), std::min(this->_tile, this->_size.x - tx*this->_tile), CV_8UC3, ptile, (size_t)this->_tile * 3);
+	}
+
+	//This function writes the image as a raw tile file
+	static void write(const std::string& path, const cv::Mat& image, unsigned int tile) {
+		if ( (image.type() != CV_8UC3) || (!tile) ) throw("Unsupported raw tile image");
+		header_t header = { { 'M', 'A', 'P', 'T', 'I', 'L', 'E', 'S' }, (uint32_t)image.cols, (uint32_t)image.rows, tile, 3 };
+		FILE* file = fopen(path.c_str(), "wb");
+		if (!file) throw("Failed to create a raw tile file");
+		bool ok = (fwrite(&header, sizeof(header_t), 1, file) == 1);
+		cv::Mat buffer(tile, tile, CV_8UC3);
+		for (unsigned int _ty=0 ; (ok) && (_ty*tile < (unsigned int)image.rows); _ty++)
+			for (unsigned int _tx=0 ; (ok) && (_tx*tile < (unsigned int)image.cols); _tx++) {
+				cv::Rect area(_tx*tile, _ty*tile, std::min(tile, image.cols - _tx*tile), std::min(tile, image.rows - _ty*tile));
+				cv::Mat fragment_dst(buffer, cv::Rect(0, 0, area.width, area.height));
+				buffer.setTo(cv::Scalar(0, 0, 0)), cv::Mat(image, area).copyTo(fragment_dst);
+				ok = (fwrite(buffer.data, (size_t)tile * tile * 3, 1, file) == 1);
+			}
+		if ( (fclose(file)) || (!ok) ) throw("Failed to write a raw tile file");
+	}
+};
+
+//This object is a tiled background map; tiles are loaded lazily through a bounded LRU cache and prefetched in the pan direction by a worker thread.
+//Tiles of the zoom levels are downsampled from the four tiles of the previous level; each level has its own cache budget, so building
+//a tile does not evict the finished tiles of the levels above
+class MapTiledBackground : public MapBackground{
+private:
+	typedef uint64_t tile_key_t; //(level << 56) | (ty << 28) | tx
+	std::unique_ptr<MapTileSource> source;
+	unsigned int cache_size;   //Cache capacity per zoom level (tiles)
+	std::vector<std::list<tile_key_t>> lru; //Cached tiles per zoom level, the most recently used first
+	std::unordered_map<tile_key_t, std::pair<cv::Mat, std::list<tile_key_t>::iterator>> cache;
+	std::deque<tile_key_t> prefetch_queue;
+	std::mutex mutex;
+	std::condition_variable prefetch_cv;
+	bool prefetch_stop;
+	std::thread prefetch_thread;
+
+	//This function puts the tile into the cache evicting the least recently used ones; the mutex must be locked
+	void cache_put(tile_key_t key, const cv::Mat& tile) {
+		if (this->cache.count(key)) return;
+		std::list<tile_key_t>& lru = this->lru[key >> 56];
+		lru.push_front(key);
+		this->cache.emplace(key, std::make_pair(tile, lru.begin()));
+		while (lru.size() > this->cache_size) this->cache.erase(lru.back()), lru.pop_back();
+	}
+
+	//This function loads the tile of the zoom level; it returns an empty image on failure
+	cv::Mat load(unsigned int level, unsigned int tx, unsigned int ty) {
+		if (!level) return this->source->load(tx, ty);
+		unsigned int tile = this->source->tile;
+		coord2D_t<unsigned int> size = this->level_size(level - 1);
+		cv::Rect area = cv::Rect(2*tx*tile, 2*ty*tile, 2*tile, 2*tile) & cv::Rect(0, 0, size.x, size.y);
+		if (!area.area()) return cv::Mat();
+		cv::Mat parent(area.height, area.width, CV_8UC3), image;
+		this->copy_to(level - 1, area, parent);
+		MapBackground::level_downsample(parent, image);
+		return image;
+	}
+
+	//This function returns the tile from the cache or loads it
+	cv::Mat fetch(unsigned int level, unsigned int tx, unsigned int ty) {
+		tile_key_t key = ((tile_key_t)level << 56) | ((tile_key_t)ty << 28) | tx;
+		{
+			std::lock_guard<std::mutex> lock(this->mutex);
+			auto it = this->cache.find(key);
+			if (it != this->cache.end()) {
+				this->lru[level].splice(this->lru[level].begin(), this->lru[level], it->second.second);
+				return it->second.first;
+			}
+		}
+		cv::Mat tile = this->load(level, tx, ty);
+		if (tile.empty()) throw("Failed to load a map tile");
+		std::lock_guard<std::mutex> lock(this->mutex);
+		this->cache_put(key, tile);
+		return tile;
+	}
+
+	//The prefetch worker
+	void prefetch_loop(void) {
+		std::unique_lock<std::mutex> lock(this->mutex);
+		while (true) {
+			this->prefetch_cv.wait(lock, [this] { return (this->prefetch_stop) || (!this->prefetch_queue.empty()); });
+			if (this->prefetch_stop) return;
+			tile_key_t key = this->prefetch_queue.front();
+			this->prefetch_queue.pop_front();
+			if (this->cache.count(key)) continue;
+			lock.unlock();
+			cv::Mat tile;
+			try { tile = this->load((unsigned int)(key >> 56), (unsigned int)(key & 0xFFFFFFF), (unsigned int)((key >> 28) & 0xFFFFFFF)); }
+			catch (...) { } //A failed prefetch is retried by the foreground fetch
+			lock.lock();
+			if (!tile.empty()) this->cache_put(key, tile);
+		}
+	}
+public:
+	MapTiledBackground(std::unique_ptr<MapTileSource> source, unsigned int cache_size = 64) : source(std::move(source)) {
+		if (!this->source) throw("No map tile source");
+		this->_size = this->source->size, this->cache_size = (cache_size) ? cache_size : 1, this->prefetch_stop = false;
+		this->lru.resize(this->levels());
+		this->prefetch_thread = std::thread(&MapTiledBackground::prefetch_loop, this);
+	}
+	~MapTiledBackground() {
+		{ std::lock_guard<std::mutex> lock(this->mutex); this->prefetch_stop = true; }
+		this->prefetch_cv.notify_all();
+		this->prefetch_thread.join();
+	}
+
+	void copy_to(unsigned int level, const cv::Rect& area, cv::Mat& dst) override {
+		unsigned int tile = this->source->tile;
+		for (unsigned int _ty=area.y/tile ; _ty*tile < (unsigned int)(area.y + area.height); _ty++)
+			for (unsigned int _tx=area.x/tile ; _tx*tile < (unsigned int)(area.x + area.width); _tx++) {
+				cv::Mat tile_image = this->fetch(level, _tx, _ty);
+				cv::Rect part = cv::Rect(_tx*tile, _ty*tile, tile_image.cols, tile_image.rows) & area;
+				cv::Mat fragment_src(tile_image, cv::Rect(part.x - _tx*tile, part.y - _ty*tile, part.width, part.height));
+				cv::Mat fragment_dst(dst, cv::Rect(part.x - area.x, part.y - area.y, part.width, part.height));
+				fragment_src.copyTo(fragment_dst);
+			}
+	}
+
+	//The tiles one tile ahead of the area in the pan direction are queued; stale requests are dropped
+	void prefetch(unsigned int level, const cv::Rect& area, int dx, int dy) override {
+		if ( (!dx) && (!dy) ) return;
+		int tile = (int)this->source->tile;
+		coord2D_t<unsigned int> size = this->level_size(level);
+		cv::Rect ahead = cv::Rect(area.x + ((dx > 0) ? tile : (dx < 0) ? -tile : 0), area.y + ((dy > 0) ? tile : (dy < 0) ? -tile : 0), area.width, area.height) & cv::Rect(0, 0, size.x, size.y);
+		if (!ahead.area()) return;
+		{
+			std::lock_guard<std::mutex> lock(this->mutex);
+			this->prefetch_queue.clear();
+			for (int _ty=ahead.y/tile ; _ty*tile < ahead.y + ahead.height; _ty++)
+				for (int _tx=ahead.x/tile ; _tx*tile < ahead.x + ahead.width; _tx++) {
+					tile_key_t key = ((tile_key_t)level << 56) | ((tile_key_t)_ty << 28) | (tile_key_t)_tx;
+					if (!this->cache.count(key)) this->prefetch_queue.push_back(key);
+				}
+		}
+		this->prefetch_cv.notify_one();
+	}
+};
+
+//This object runs f(index) for the indices of the loop ranges given by cv::parallel_for_; the first failure is kept for the caller
+template<typename F>
+class MapParallelRunner : public cv::ParallelLoopBody {
+private:
+	const F& f;
+	mutable std::mutex mutex;
+	mutable std::exception_ptr error; //The first failure of an index
+public:
+	MapParallelRunner(const F& f) : f(f) { }
+	void operator()(const cv::Range& range) const override {
+		for (int _i=range.start ; _i != range.end; _i++) {
+			try { this->f(_i); }
+			catch (...) {
+				std::lock_guard<std::mutex> lock(this->mutex);
+				if (!this->error) this->error = std::current_exception();
+			}
+		}
+	}
+	void rethrow(void) const { if (this->error) std::rethrow_exception(this->error); }
+};
+
+//This function calls f(index) for the indices [0, count) in parallel split into the stripes (-1 is the default split); the first failure is re-thrown
+template<typename F>
+void map_parallel_for(int count, const F& f, double stripes = -1.) {
+	MapParallelRunner<F> runner(f);
+	cv::parallel_for_(cv::Range(0, count), runner, stripes);
+	runner.rethrow();
+}
+
+class MapWidget;
+
+//This object is the map shared by its views (MapWidget): the background source, the marker registry with the shared sprites,
+//the marker positions and the spatial index over them. Marker moves are applied once and passed to the views whose windows
+//they touch; the views are updated and drawn in parallel. The map and its views are driven from one thread; a MapWidgetPipeline
+//renders on its own thread, so its view must be the only one of the map
+class MapModel{
+private:
+	friend class MapWidget;
+	friend class MapWidgetPipeline;
+	const unsigned int marker_grid_cell = 128; //Spatial index cell size (pixels)
+
+	typedef std::tuple<const unsigned char*, int, int, size_t, unsigned char, unsigned char, unsigned char, float, float, unsigned int, unsigned int, unsigned int, unsigned int> sprite_key_t; //Source image identity and marker features
+	std::map<sprite_key_t, std::shared_ptr<const MapMarkerWidget::sprite_t>> marker_sprites; //Flyweight cache of marker sprites
+
+	std::shared_ptr<MapBackground> background; //The background map source
+	std::vector<std::shared_ptr<const MapMarkerWidget::sprite_t>> markers; //Sprites of the registered markers
+	std::vector<coord2D_t<unsigned int>> marker_coords2D;
+	std::vector<unsigned int> batch_markers; //Scratch list of the markers moved by a batch
+	std::vector<char> marker_flags;       //Scratch flags of the markers listed in a batch
+	coord2D_t<unsigned int> marker_reach; //The largest marker extent around its origin
+	MapMarkerGrid marker_grid;            //Spatial index over marker_coords2D
+	std::vector<MapWidget*> views, touched_views; //The registered views and the scratch list of the ones a batch touches
+	bool pipelined;                       //The only view is rendered by a pipeline; no more views may be attached
+
+	//This function calls f(view) for the views in parallel; a single view is served on the calling thread, so its own band rendering stays parallel
+	template<typename F>
+	void for_views(const std::vector<MapWidget*>& views, const F& f) {
+		if (views.size() == 1) { f(views[0]); return; }
+		map_parallel_for((int)views.size(), [&views, &f](int view) { f(views[view]); });
+	}
+
+	//These functions register and unregister a view; they are called by the view itself
+	void attach(MapWidget* view) { this->views.push_back(view); }
+	void detach(MapWidget* view) { this->views.erase(std::remove(this->views.begin(), this->views.end(), view), this->views.end()); }
+public:
+	const coord2D_t<unsigned int>& map_size; //Read-only background map size
+
+	//The constructor over a decoded background image
+	MapModel(const cv::Mat& background_image) : MapModel(std::make_shared<MapImageBackground>(background_image)) { }
+
+	//The constructor over a background source (e.g. MapTiledBackground)
+	MapModel(std::shared_ptr<MapBackground> background) :
+		background(background),
+		marker_grid(background->size.x, background->size.y, MapModel::marker_grid_cell),
+		map_size(background->size) {
+		this->marker_reach.x = 0, this->marker_reach.y = 0, this->pipelined = false;
+	}
+	MapModel(const MapModel&) = delete;
+	MapModel& operator=(const MapModel&) = delete;
+
+	//This function returns the number of the registered markers
+	unsigned int markers_count(void) const { return (unsigned int)this->markers.size(); }
+
+	//This function returns the number of zoom levels of the map; the valid ones are [0, zoom_levels())
+	unsigned int zoom_levels(void) const { return this->background->levels(); }
+
+	//This method register photo widget in the map and in all its views
+	unsigned int marker_add(unsigned int map_x,unsigned int map_y,unsigned char color[3], float fshape_x, float fshape_y, unsigned int border_x, unsigned int border_y, unsigned int length_x, unsigned int length_y, const cv::Mat& src_pimage);
+
+	//The function update marker on the map
+	void marker_update(unsigned int marker_id, unsigned int x, unsigned int y) {
+		this->marker_update_batch(std::vector<unsigned int>(1, marker_id), std::vector<coord2D_t<unsigned int>>(1, { x, y }));
+	}
+
+	//The function update several markers at once: the positions and the spatial index are updated once, then every view showing
+	//a moved marker or the place it moves to re-draws the markers in parallel (MapWidget::marker_update_batch()). A marker listed twice gets the last coordinates
+	void marker_update_batch(const std::vector<unsigned int>& marker_ids, const std::vector<coord2D_t<unsigned int>>& coords);
+
+	//The re-drawing of all views in parallel
+	void draw(void);
+};
+
+//The map object
+class MapWidget{
+private :
+	friend class MapModel;
+	const unsigned char background_color[3] = {0xCC, 0xCC, 0xCC}; //Gray80
+	static const unsigned int damage_limit = 256;                 //Damaged areas kept before they are merged
+	static const unsigned int ORIENT_CANDIDATES = 2 + MapMarkerWidget::ORIENT::ORIENT_LAST; //The hint, the default and every orientation
+    coord2D_t<unsigned int> _window_size;    //Map window size
+	coord2D_t<unsigned int> _window_center;  //Map center [0,1]
+	rect2D_t<unsigned int>  _window_proj;    //Projective window (zoom level pixels)
+	unsigned int _zoom;                      //Zoom level; 0 is 1:1, each level halves the map
+	coord2D_t<unsigned int> level_center;    //Map center at the zoom level of the rendered image
+	cv::Mat     _image;  //The output image (final)
+
+	std::shared_ptr<MapModel> _model;     //The shared map: the background, the markers and their positions
+	std::vector<std::unique_ptr<MapMarkerWidget>> MapMarkerWidgets; //The view state of the markers (placement, stacking, back-ups)
+	std::vector<unsigned int> drawn_markers, tmp_markers; //A stack actually but with random read access
+	std::vector<unsigned int> under_markers; //Scratch list of the markers recomposed under an erased one
+	std::vector<cv::Rect> recompose_rects;   //Scratch list of the erased frames merged into disjoint areas
+	std::vector<unsigned int> erased_markers; //Scratch list of the markers erased by a pan or a full re-drawing; the ones not drawn again free their save-under buffers
+	std::vector<unsigned int> marker_z;   //Stacking stamps; drawn_markers is sorted by them
+	std::vector<char> marker_flags;       //Scratch visit flags of the erase cascade
+	unsigned int z_top;                   //Next free stacking stamp
+	coord2D_t<unsigned int> drawn_center; //Map center (zoom level pixels) of the rendered image
+	unsigned int drawn_zoom;              //Zoom level of the rendered image
+	bool drawn_valid;                     //The rendered image may be scrolled
+	bool incremental_pan;                 //Scroll the rendered image on small pans instead of the full re-drawing
+	std::vector<cv::Rect> damage_rects;   //Areas of the output image changed since the last take_damage()
+	unsigned int render_bands;            //Horizontal bands of the full re-drawing rendered in parallel; 1 is the serial drawing, 0 is one per thread
+	bool orient_solver;                   //Orient the markers put on the top of the stack to overlap the drawn ones the least
+	bool save_under;                      //The markers keep the background under them; otherwise erasing recomposes the image
+	map_stats_t stats;                    //Render counters of the current stats frame
+	std::unique_ptr<std::FILE, int (*)(std::FILE*)> stats_trace; //CSV trace of the stats frames
+
+	//This function returns true if a map point falls into the projective window
+	bool in_window(unsigned int x, unsigned int y) const {
+		x >>= this->_zoom, y >>= this->_zoom;
+		return (x >= this->level_center.x - this->_window_proj.x) && (x < this->level_center.x + this->_window_proj.size_x) && (y >= this->level_center.y - this->_window_proj.y) && (y < this->level_center.y + this->_window_proj.size_y);
+	}
+
+	//This function returns the output image origin of the marker at the zoom level
+	coord2D_t<unsigned int> marker_origin(unsigned int marker_id) const {
+		return { (this->_model->marker_coords2D[marker_id].x >> this->_zoom) - this->level_center.x + this->_window_size.x/2, (this->_model->marker_coords2D[marker_id].y >> this->_zoom) - this->level_center.y + this->_window_size.y/2 };
+	}
+
+	//This function scales the map area from the zoom level pixels to the spatial index ones
+	rect2D_t<int> level_to_map(const rect2D_t<int>& area) const {
+		int scale = 1 << this->_zoom;
+		return { area.x * scale, area.y * scale, area.size_x * scale, area.size_y * scale };
+	}
+
+	//This function returns the spatial index area holding every marker whose frame may overlap the output image area [x, size_x) x [y, size_y)
+	rect2D_t<int> marker_query(const rect2D_t<int>& area) const {
+		coord2D_t<int> shift = { .x = (int)this->drawn_center.x - (int)this->_window_size.x/2, .y = (int)this->drawn_center.y - (int)this->_window_size.y/2 }; //Output image to map
+		const coord2D_t<unsigned int>& reach = this->_model->marker_reach;
+		return this->level_to_map({ area.x + shift.x - (int)reach.x, area.y + shift.y - (int)reach.y, area.size_x + shift.x + (int)reach.x + 1, area.size_y + shift.y + (int)reach.y + 1 });
+	}
+
+	//This function collects drawn markers whose frames overlap the already collected ones from above (tmp_markers holds the seeds)
+	void marker_cascade(void) {
+		MAP_STATS(MapStatsTimer timer(this->stats.time_cascade); this->stats.markers_cascaded -= (unsigned int)this->tmp_markers.size());
+		for (unsigned int _i=0 ; _i != this->tmp_markers.size(); _i++) this->marker_flags[this->tmp_markers[_i]] = 1;
+		for (unsigned int _i=0 ; _i != this->tmp_markers.size(); _i++) {
+			unsigned int marker_id = this->tmp_markers[_i];
+			const rect2D_t<int>& frame = this->MapMarkerWidgets[marker_id]->drawn_frame;
+			this->_model->marker_grid.query(this->marker_query(frame), [this, marker_id, &frame](unsigned int _j) {
+				if ( (!this->marker_flags[_j]) && (this->MapMarkerWidgets[_j]->drawn_orient != (unsigned int)-1) && (this->marker_z[_j] > this->marker_z[marker_id]) && (rect_overlap(this->MapMarkerWidgets[_j]->drawn_frame, frame)) ) {
+					this->marker_flags[_j] = 1;
+					this->tmp_markers.push_back(_j);
+				}
+			});
+		}
+		for (unsigned int _i=0 ; _i != this->tmp_markers.size(); _i++) this->marker_flags[this->tmp_markers[_i]] = 0;
+		MAP_STATS(this->stats.markers_cascaded += (unsigned int)this->tmp_markers.size());
+		std::sort(this->tmp_markers.begin(), this->tmp_markers.end(), [this](unsigned int a, unsigned int b) { return this->marker_z[a] < this->marker_z[b]; });
+	}
+
+	//This function hints the marker orientation covering the least area of the drawn markers around; the marker origin must be set.
+	//It is called for markers put on the top of the stack only, since any frame of theirs may cover the stack; the ties keep the current hint
+	void marker_solve(unsigned int marker_id) {
+		MapMarkerWidget& marker = *this->MapMarkerWidgets[marker_id];
+		coord2D_t<unsigned int> origin = this->marker_origin(marker_id);
+		unsigned int candidates[ORIENT_CANDIDATES] = { marker.orient_hint, marker.default_orient, MapMarkerWidget::ORIENT::ORIENT_NW, MapMarkerWidget::ORIENT::ORIENT_NE, MapMarkerWidget::ORIENT::ORIENT_SW, MapMarkerWidget::ORIENT::ORIENT_SE };
+		unsigned int best_orient = (unsigned int)-1;
+		unsigned long long best_overlap = (unsigned long long)-1;
+		for (unsigned int orient : candidates) {
+			if ( (orient >= MapMarkerWidget::ORIENT::ORIENT_LAST) || (!marker.fits(orient, origin, this->_image)) ) continue;
+			rect2D_t<int> frame = marker.frame_at(orient, origin);
+			unsigned long long overlap = 0;
+			this->_model->marker_grid.query(this->marker_query(frame), [this, marker_id, &frame, &overlap](unsigned int _j) {
+				if ( (_j == marker_id) || (this->MapMarkerWidgets[_j]->drawn_orient == (unsigned int)-1) ) return;
+				const rect2D_t<int>& drawn_frame = this->MapMarkerWidgets[_j]->drawn_frame;
+				int width = std::min(frame.size_x, drawn_frame.size_x) - std::max(frame.x, drawn_frame.x), height = std::min(frame.size_y, drawn_frame.size_y) - std::max(frame.y, drawn_frame.y);
+				if ( (width > 0) && (height > 0) ) overlap += (unsigned long long)width * height;
+			});
+			if (overlap < best_overlap) best_orient = orient, best_overlap = overlap;
+			if (!overlap) break;
+		}
+		marker.set_orient_hint(best_orient); //None fits: the border rules apply
+	}
+
+	//This function puts a drawn marker on the top of the stack
+	void marker_push(unsigned int marker_id) {
+		if (this->z_top == (unsigned int)-1) { //Restamp the stack
+			for (unsigned int _i=0 ; _i != this->drawn_markers.size(); _i++) this->marker_z[this->drawn_markers[_i]] = _i;
+			this->z_top = (unsigned int)this->drawn_markers.size();
+		}
+		this->marker_z[marker_id] = this->z_top++;
+		this->drawn_markers.push_back(marker_id);
+	}
+
+	//This function draws markers of the projective window which are not drawn yet in the registration order
+	void marker_draw_window(void) {
+        rect2D_t<int> area = { (int)(this->level_center.x - this->_window_proj.x), (int)(this->level_center.y - this->_window_proj.y), (int)(this->level_center.x + this->_window_proj.size_x), (int)(this->level_center.y + this->_window_proj.size_y) };
+        this->_model->marker_grid.query(this->level_to_map(area), [this](unsigned int marker_id) {
+        	if ( (this->MapMarkerWidgets[marker_id]->drawn_orient == (unsigned int)-1) && (this->in_window(this->_model->marker_coords2D[marker_id].x, this->_model->marker_coords2D[marker_id].y)) ) this->tmp_markers.push_back(marker_id);
+        	else MAP_STATS(if (this->MapMarkerWidgets[marker_id]->drawn_orient == (unsigned int)-1) this->stats.markers_culled++);
+        });
+        std::sort(this->tmp_markers.begin(), this->tmp_markers.end());
+        for (unsigned int marker_id : this->tmp_markers) {
+        	coord2D_t<unsigned int> origin = this->marker_origin(marker_id);
+        	this->MapMarkerWidgets[marker_id]->set_origin(origin.x, origin.y);
+        	if (this->orient_solver) this->marker_solve(marker_id);
+        	this->marker_draw(marker_id);
+        	if (this->MapMarkerWidgets[marker_id]->drawn_orient != (unsigned int)-1) this->marker_push(marker_id);
+        }
+        this->tmp_markers.clear();
+	}
+
+	//This function is the full re-drawing split into horizontal bands rendered in parallel; the markers are placed serially
+	//in the registration order first, so every band sees the same stack and the image equals the serial drawing bit by bit
+	void draw_bands(void) {
+        rect2D_t<int> area = { (int)(this->level_center.x - this->_window_proj.x), (int)(this->level_center.y - this->_window_proj.y), (int)(this->level_center.x + this->_window_proj.size_x), (int)(this->level_center.y + this->_window_proj.size_y) };
+        this->_model->marker_grid.query(this->level_to_map(area), [this](unsigned int marker_id) {
+        	if (this->in_window(this->_model->marker_coords2D[marker_id].x, this->_model->marker_coords2D[marker_id].y)) this->tmp_markers.push_back(marker_id);
+        	else MAP_STATS(this->stats.markers_culled++);
+        });
+        std::sort(this->tmp_markers.begin(), this->tmp_markers.end());
+        for (unsigned int marker_id : this->tmp_markers) {
+        	coord2D_t<unsigned int> origin = this->marker_origin(marker_id);
+        	this->MapMarkerWidgets[marker_id]->set_origin(origin.x, origin.y);
+        	if (this->orient_solver) this->marker_solve(marker_id);
+        	if (this->MapMarkerWidgets[marker_id]->place(this->_image) != (unsigned int)-1) this->marker_push(marker_id);
+        	MAP_STATS(this->marker_drawn_stats(marker_id));
+        }
+        this->tmp_markers.clear();
+        int bands = (this->render_bands) ? (int)this->render_bands : std::max(cv::getNumThreads(), 1);
+        bands = std::min(bands, (int)this->_window_size.y);
+        MAP_STATS(MapStatsTimer timer(this->stats.time_draw); this->stats.pixels_blitted += (unsigned long long)this->_window_size.x * this->_window_size.y);
+        this->damage(cv::Rect(0, 0, this->_window_size.x, this->_window_size.y));
+        //Every band paints its own rows of the output image and of the marker back-ups
+        map_parallel_for(bands, [this, bands](int band) {
+        	int row_begin = (int)this->_window_size.y * band / bands, row_end = (int)this->_window_size.y * (band + 1) / bands;
+        	if (row_begin == row_end) return;
+        	cv::Rect rows(0, row_begin, this->_window_size.x, row_end - row_begin);
+        	this->paint_background(rows);
+        	for (unsigned int marker_id : this->drawn_markers) this->MapMarkerWidgets[marker_id]->render(this->_image, rows);
+        }, bands);
+	}
+
+	//This function draws the marker into the output image recording the damage
+	void marker_draw(unsigned int marker_id) {
+		MAP_STATS(MapStatsTimer timer(this->stats.time_draw));
+		this->MapMarkerWidgets[marker_id]->draw(this->_image);
+		if (this->MapMarkerWidgets[marker_id]->drawn_orient != (unsigned int)-1) this->damage(this->MapMarkerWidgets[marker_id]->drawn_frame);
+		MAP_STATS(this->marker_drawn_stats(marker_id));
+	}
+
+	//This function counts the drawing (or placing) of the marker
+	void marker_drawn_stats(unsigned int marker_id) {
+		unsigned int pixels = this->MapMarkerWidgets[marker_id]->pixels();
+		if (!pixels) { this->stats.markers_culled++; return; }
+		this->stats.markers_drawn++, this->stats.pixels_blitted += pixels;
+		if (this->save_under) this->stats.backups++, this->stats.backup_pixels += pixels;
+	}
+
+	//This function erases the collected markers (tmp_markers in the stacking order) top-down from their save-under buffers or,
+	//without the buffers, recomposes their frames from the background and the drawn markers left below them. The frames are merged
+	//into disjoint areas recomposed once each; the collected markers are reset first, so the ones the caller redraws are not rendered
+	void marker_erase_collected(void) {
+		if (this->save_under) {
+			unsigned int _i = this->tmp_markers.size(); while ( (_i--)) this->marker_erase(this->tmp_markers[_i]);
+			return;
+		}
+		MAP_STATS(MapStatsTimer timer(this->stats.time_erase));
+		for (unsigned int marker_id : this->tmp_markers)
+			if (this->MapMarkerWidgets[marker_id]->drawn_orient != (unsigned int)-1) {
+				const rect2D_t<int>& frame = this->MapMarkerWidgets[marker_id]->drawn_frame;
+				MAP_STATS(this->stats.markers_erased++);
+				this->damage(frame);
+				this->recompose_rects.push_back(cv::Rect(frame.x, frame.y, frame.size_x - frame.x, frame.size_y - frame.y) & cv::Rect(0, 0, this->_window_size.x, this->_window_size.y));
+				this->MapMarkerWidgets[marker_id]->reset_drawn_orient_flag();
+			}
+		damage_merge(this->recompose_rects);
+		for (const cv::Rect& area : this->recompose_rects)
+			if (area.area()) this->recompose(area);
+		this->recompose_rects.clear();
+	}
+
+	//This function recomposes the output image area from the background and the drawn markers in the stacking order
+	void recompose(const cv::Rect& area) {
+		this->paint_background(area, this->drawn_center);
+		MAP_STATS(this->stats.pixels_blitted += (unsigned long long)area.area());
+		this->_model->marker_grid.query(this->marker_query({ area.x, area.y, area.x + area.width, area.y + area.height }), [this, &area](unsigned int marker_id) {
+			const rect2D_t<int>& frame = this->MapMarkerWidgets[marker_id]->drawn_frame;
+			if ( (this->MapMarkerWidgets[marker_id]->drawn_orient != (unsigned int)-1) && (frame.x < area.x + area.width) && (area.x < frame.size_x) && (frame.y < area.y + area.height) && (area.y < frame.size_y) ) this->under_markers.push_back(marker_id);
+		});
+		std::sort(this->under_markers.begin(), this->under_markers.end(), [this](unsigned int a, unsigned int b) { return this->marker_z[a] < this->marker_z[b]; });
+		for (unsigned int marker_id : this->under_markers) {
+			this->MapMarkerWidgets[marker_id]->render(this->_image, area);
+			MAP_STATS(const rect2D_t<int>& frame = this->MapMarkerWidgets[marker_id]->drawn_frame; this->stats.pixels_blitted += (unsigned long long)(cv::Rect(frame.x, frame.y, frame.size_x - frame.x, frame.size_y - frame.y) & area).area());
+		}
+		this->under_markers.clear();
+	}
+
+	//This function erases the marker from the output image recording the damage
+	void marker_erase(unsigned int marker_id) {
+		MAP_STATS(MapStatsTimer timer(this->stats.time_erase); if (this->MapMarkerWidgets[marker_id]->drawn_orient != (unsigned int)-1) this->stats.markers_erased++, this->stats.pixels_blitted += this->MapMarkerWidgets[marker_id]->pixels());
+		if (this->MapMarkerWidgets[marker_id]->drawn_orient != (unsigned int)-1) this->damage(this->MapMarkerWidgets[marker_id]->drawn_frame);
+		this->MapMarkerWidgets[marker_id]->erase(this->_image);
+	}
+
+	//This function records a changed area of the output image
+	void damage(const cv::Rect& area) {
+		cv::Rect rect = area & cv::Rect(0, 0, this->_window_size.x, this->_window_size.y);
+		if (!rect.area()) return;
+		this->damage_rects.push_back(rect);
+		if (this->damage_rects.size() > MapWidget::damage_limit) { //Nobody takes the damage; keep the list short
+			damage_merge(this->damage_rects);
+			damage_collapse(this->damage_rects, MapWidget::damage_limit/2);
+		}
+	}
+	void damage(const rect2D_t<int>& frame) { this->damage(cv::Rect(frame.x, frame.y, frame.size_x - frame.x, frame.size_y - frame.y)); }
+
+	//This function paints the map background into the output image area
+	void draw_background(const cv::Rect& area) {
+		MAP_STATS(MapStatsTimer timer(this->stats.time_background); this->stats.pixels_blitted += (unsigned long long)area.area());
+		this->damage(area);
+		this->paint_background(area);
+	}
+
+	//This function paints the map background into the output image area without recording the damage
+	void paint_background(const cv::Rect& area) { this->paint_background(area, this->level_center); }
+	//The same for an image rendered around the given center (the scrolling recomposes the image before it is moved to the new center)
+	void paint_background(const cv::Rect& area, const coord2D_t<unsigned int>& center) {
+        cv::Mat(this->_image, area).setTo(cv::Scalar(MapWidget::background_color[0], MapWidget::background_color[1], MapWidget::background_color[2]));
+        coord2D_t<unsigned int> level_size = this->_model->background->level_size(this->_zoom);
+        rect2D_t<unsigned int> proj = { std::min(center.x, this->_window_size.x/2), std::min(center.y, this->_window_size.y/2), std::min(level_size.x - center.x, this->_window_size.x/2), std::min(level_size.y - center.y, this->_window_size.y/2) };
+        cv::Rect map_area = cv::Rect(this->_window_size.x/2 - proj.x, this->_window_size.y/2 - proj.y, proj.x + proj.size_x, proj.y + proj.size_y) & area;
+        if (map_area.area()) {
+        	cv::Mat fragment_dst(this->_image, map_area);
+        	this->_model->background->copy_to(this->_zoom, cv::Rect(map_area.x - this->_window_size.x/2 + center.x, map_area.y - this->_window_size.y/2 + center.y, map_area.width, map_area.height), fragment_dst);
+        }
+	}
+
+	//This function scrolls the rendered image by the center delta; only markers which cannot be kept as they are and the exposed strips are redrawn
+	void scroll(int dx, int dy) {
+		int size_x = (int)this->_window_size.x, size_y = (int)this->_window_size.y;
+		cv::Rect kept(std::max(-dx, 0), std::max(-dy, 0), size_x - std::abs(dx), size_y - std::abs(dy)); //The surviving area of the new image
+		//Erase markers leaving the surviving area or changing orientation at the image borders, with the ones overlapping them from above
+		for (unsigned int marker_id : this->drawn_markers) {
+			const coord2D_t<unsigned int>& coord = this->_model->marker_coords2D[marker_id];
+			const rect2D_t<int>& frame = this->MapMarkerWidgets[marker_id]->drawn_frame;
+			coord2D_t<unsigned int> origin = this->marker_origin(marker_id);
+			if ( (!this->in_window(coord.x, coord.y)) || (frame.x - dx < kept.x) || (frame.y - dy < kept.y) || (frame.size_x - dx > kept.x + kept.width) || (frame.size_y - dy > kept.y + kept.height) || (this->MapMarkerWidgets[marker_id]->orient_at(origin, this->_image) != this->MapMarkerWidgets[marker_id]->drawn_orient) )
+				this->tmp_markers.push_back(marker_id);
+		}
+		if (!this->tmp_markers.empty()) {
+			this->marker_cascade();
+			this->marker_erase_collected();
+			this->drawn_markers.erase(std::remove_if(this->drawn_markers.begin(), this->drawn_markers.end(), [this](unsigned int marker_id) { return this->MapMarkerWidgets[marker_id]->drawn_orient == (unsigned int)-1; }), this->drawn_markers.end());
+			this->erased_markers.insert(this->erased_markers.end(), this->tmp_markers.begin(), this->tmp_markers.end());
+			this->tmp_markers.clear();
+		}
+		//Move the image content in place; the row order keeps the source rows intact
+		{
+			MAP_STATS(MapStatsTimer timer(this->stats.time_scroll); this->stats.pixels_blitted += (unsigned long long)kept.area());
+			size_t bytes = (size_t)kept.width * this->_image.elemSize(), src_x = (size_t)std::max(dx, 0) * this->_image.elemSize(), dst_x = (size_t)kept.x * this->_image.elemSize();
+			if (dy >= 0) for (int _r=0 ; _r < kept.height; _r++) std::memmove(this->_image.ptr<unsigned char>(_r) + dst_x, this->_image.ptr<unsigned char>(_r + dy) + src_x, bytes);
+			else for (int _r=size_y-1 ; _r >= kept.y; _r--) std::memmove(this->_image.ptr<unsigned char>(_r) + dst_x, this->_image.ptr<unsigned char>(_r + dy) + src_x, bytes);
+		}
+		for (unsigned int marker_id : this->drawn_markers) this->MapMarkerWidgets[marker_id]->shift(-dx, -dy);
+		this->drawn_center = this->level_center;
+		if ( (dx) || (dy) ) this->damage(cv::Rect(0, 0, size_x, size_y));
+		//Draw the exposed strips and the markers which are not drawn yet
+		if (dy > 0) this->draw_background(cv::Rect(0, kept.height, size_x, dy));
+		if (dy < 0) this->draw_background(cv::Rect(0, 0, size_x, -dy));
+		if (dx > 0) this->draw_background(cv::Rect(kept.width, kept.y, dx, kept.height));
+		if (dx < 0) this->draw_background(cv::Rect(0, kept.y, -dx, kept.height));
+		this->marker_draw_window();
+		this->marker_release_erased();
+	}
+
+	//This function frees the save-under buffers of the erased markers which were not drawn again; a view keeps them for its visible markers only
+	void marker_release_erased(void) {
+		for (unsigned int marker_id : this->erased_markers) this->MapMarkerWidgets[marker_id]->release_save_under();
+		this->erased_markers.clear();
+	}
+
+	//This function appends the view state of a marker registered in the map
+	void marker_added(const std::shared_ptr<const MapMarkerWidget::sprite_t>& sprite) {
+		this->MapMarkerWidgets.push_back(std::make_unique<MapMarkerWidget>(sprite));
+		if (!this->save_under) this->MapMarkerWidgets.back()->set_save_under(false);
+		this->MapMarkerWidgets.back()->set_origin((unsigned int)-1, (unsigned int)-1);
+		this->marker_z.push_back(0), this->marker_flags.push_back(0);
+	}
+
+	//This function returns true if any of the moved markers is drawn in the view or moves into its projective window
+	bool marker_touched(const std::vector<unsigned int>& moved_markers) const {
+		for (unsigned int marker_id : moved_markers)
+			if ( (this->MapMarkerWidgets[marker_id]->drawn_orient != (unsigned int)-1) || (this->in_window(this->_model->marker_coords2D[marker_id].x, this->_model->marker_coords2D[marker_id].y)) ) return true;
+		return false;
+	}
+
+	//This function re-draws the view after the markers were moved in the map (listed once each): the drawn ones are erased
+	//with the markers overlapping them from above using bread-first method over the spatial index, the others are redrawn
+	void marker_moved(const std::vector<unsigned int>& moved_markers) {
+		for (unsigned int marker_id : moved_markers)
+			if (this->MapMarkerWidgets[marker_id]->drawn_orient != (unsigned int)-1) this->tmp_markers.push_back(marker_id);
+		if (!this->tmp_markers.empty()) {
+			this->marker_cascade();
+			this->marker_erase_collected();
+			for (unsigned int marker_id : moved_markers) this->marker_flags[marker_id] = 1;
+			for (unsigned int marker_id : this->tmp_markers)
+				if (!this->marker_flags[marker_id]) this->marker_draw(marker_id);
+			for (unsigned int marker_id : moved_markers) this->marker_flags[marker_id] = 0;
+			this->drawn_markers.erase(std::remove_if(this->drawn_markers.begin(), this->drawn_markers.end(), [this](unsigned int marker_id) { return this->MapMarkerWidgets[marker_id]->drawn_orient == (unsigned int)-1; }), this->drawn_markers.end());
+			this->tmp_markers.clear();
+		}
+		//Draw the moved markers; put them into the end of stack as they are expected to move more
+		for (unsigned int marker_id : moved_markers)
+			if (this->in_window(this->_model->marker_coords2D[marker_id].x, this->_model->marker_coords2D[marker_id].y)) {
+				coord2D_t<unsigned int> origin = this->marker_origin(marker_id);
+				this->MapMarkerWidgets[marker_id]->set_origin(origin.x, origin.y);
+				if (this->orient_solver) this->marker_solve(marker_id);
+				this->marker_draw(marker_id);
+				if (this->MapMarkerWidgets[marker_id]->drawn_orient != (unsigned int)-1) this->marker_push(marker_id);
+			}
+		//The moved markers which left the window free their save-under buffers
+		for (unsigned int marker_id : moved_markers) this->MapMarkerWidgets[marker_id]->release_save_under();
+	}
+public :
+    const coord2D_t<unsigned int>& map_size;       //Read-only background map size
+    const coord2D_t<unsigned int>& window_size;    //Read-only map window size
+	const coord2D_t<unsigned int>& window_center;  //Read-only map center
+	const rect2D_t<unsigned int>&  window_proj;    //Read-only map window projection
+	const unsigned int& zoom;                      //Read-only zoom level
+	const cv::Mat& image;     //The read-only output map image
+	const std::shared_ptr<MapModel>& model;        //The shared map; more views may be created over it
+
+
+	//The constructor over a decoded background image
+	MapWidget(unsigned int window_center_x, unsigned int window_center_y, unsigned int window_size_x, unsigned int window_size_y, const cv::Mat& background_image) :
+		MapWidget(window_center_x, window_center_y, window_size_x, window_size_y, std::make_shared<MapModel>(background_image)) { }
+
+	//The constructor over a background source (e.g. MapTiledBackground)
+	MapWidget(unsigned int window_center_x, unsigned int window_center_y, unsigned int window_size_x, unsigned int window_size_y, std::shared_ptr<MapBackground> background) :
+		MapWidget(window_center_x, window_center_y, window_size_x, window_size_y, std::make_shared<MapModel>(background)) { }
+
+	//The constructor of a view over a shared map; the view gets the markers registered so far and is updated by the map from now on
+	MapWidget(unsigned int window_center_x, unsigned int window_center_y, unsigned int window_size_x, unsigned int window_size_y, std::shared_ptr<MapModel> model) :
+		_model(model),
+		stats_trace(nullptr, &std::fclose),
+		map_size(model->map_size),
+		window_size(this->_window_size),
+		window_center(this->_window_center),
+		window_proj(this->_window_proj),
+		zoom(this->_zoom),
+		image(this->_image),
+		model(this->_model) {
+		if (this->_model->pipelined) throw("The map is rendered by a pipeline; no more views may be attached");
+    	if ( (window_center_x >= this->map_size.x) || (window_center_y >= this->map_size.y) ) throw("Incorrect map center requested");
+    	else { this->_window_center.x = window_center_x, this->_window_center.y = window_center_y; }
+    	if ( ( (window_size_x%2))||( (window_size_y%2)) ) throw("Odd output map size requested");
+	    this->_window_size.x = window_size_x, this->_window_size.y = window_size_y, this->_zoom = 0, this->drawn_zoom = 0, this->drawn_center.x = 0, this->drawn_center.y = 0;
+        this->_image = cv::Mat(this->_window_size.y, this->_window_size.x,  CV_8UC3);
+        this->z_top = 0, this->drawn_valid = false, this->incremental_pan = false, this->render_bands = 1, this->orient_solver = false, this->save_under = true, this->stats = map_stats_t();
+        for (const std::shared_ptr<const MapMarkerWidget::sprite_t>& sprite : this->_model->markers) this->marker_added(sprite);
+	    this->draw();
+	    this->_model->attach(this);
+	}
+	MapWidget(const MapWidget&) = delete;
+	MapWidget& operator=(const MapWidget&) = delete;
+	~MapWidget() { this->_model->detach(this); }
+
+	//This routine assign a new center. It retuns +1 if the draw function need to be called
+	char set_center(unsigned int window_center_x, unsigned int window_center_y) {
+		if ( (window_center_x >= this->map_size.x) && (window_center_y >= this->map_size.y) ) return -1;
+		if ( (this->_window_center.x == window_center_x) && (this->_window_center.y == window_center_y) ) return 0;
+		else {
+			if (window_center_x < this->map_size.x) this->_window_center.x = window_center_x;
+			if (window_center_y < this->map_size.y) this->_window_center.y = window_center_y;
+			return +1;
+		}
+	}
+
+	//This function returns the number of zoom levels of the map; the valid ones are [0, zoom_levels())
+	unsigned int zoom_levels(void) const { return this->_model->zoom_levels(); }
+
+	//This routine assigns a zoom level. It retuns +1 if the draw function need to be called
+	char set_zoom(unsigned int zoom) {
+		if (zoom >= this->zoom_levels()) return -1;
+		if (this->_zoom == zoom) return 0;
+		this->_zoom = zoom;
+		return +1;
+	}
+
+	//This function turns on/off scrolling of the rendered image on small pans
+	void set_incremental_pan(bool incremental_pan) { this->incremental_pan = incremental_pan; }
+
+	//This function sets the number of horizontal bands the full re-drawing is split into and rendered in parallel: 1 is the serial drawing, 0 is one band per thread
+	void set_render_bands(unsigned int render_bands) { this->render_bands = render_bands; }
+
+	//This function turns on/off the orientation of the markers to overlap each other the least; the hints are dropped when it is turned off.
+	//The next draw is a full one
+	void set_orient_solver(bool orient_solver) {
+		this->orient_solver = orient_solver, this->drawn_valid = false;
+		if (!orient_solver) for (std::unique_ptr<MapMarkerWidget>& marker : this->MapMarkerWidgets) marker->set_orient_hint((unsigned int)-1);
+	}
+
+	//This function turns on/off the save-under buffers of the markers; they are held by the markers drawn in the view only. Without them
+	//the drawing makes no back-ups, while erasing recomposes the marker frame from the background and the markers below. The map is re-drawn
+	void set_save_under(bool save_under) {
+		this->save_under = save_under;
+		for (std::unique_ptr<MapMarkerWidget>& marker : this->MapMarkerWidgets) marker->set_save_under(save_under);
+		this->drawn_valid = false;
+		this->draw();
+	}
+
+	//This function makes the next draw a full one (e.g. after the background source content was changed)
+	void invalidate(void) { this->drawn_valid = false; }
+
+	//The map re-drawing; with the incremental mode on small pans only scroll the rendered image
+    void draw(void) {
+        coord2D_t<unsigned int> level_size = this->_model->background->level_size(this->_zoom);
+        this->level_center.x = this->_window_center.x >> this->_zoom, this->level_center.y = this->_window_center.y >> this->_zoom;
+        this->_window_proj.x = (this->level_center.x < this->_window_size.x/2) ? this->level_center.x : this->_window_size.x/2, this->_window_proj.size_x = (level_size.x - this->level_center.x < this->_window_size.x/2 ) ? level_size.x - this->level_center.x : this->_window_size.x/2;
+        this->_window_proj.y = (this->level_center.y < this->_window_size.y/2) ? this->level_center.y : this->_window_size.y/2, this->_window_proj.size_y = (level_size.y - this->level_center.y < this->_window_size.y/2 ) ? level_size.y - this->level_center.y : this->_window_size.y/2;
+        int dx = (int)this->level_center.x - (int)this->drawn_center.x, dy = (int)this->level_center.y - (int)this->drawn_center.y;
+        if ( (this->incremental_pan) && (this->drawn_valid) && (this->drawn_zoom == this->_zoom) && (std::abs(dx) < (int)this->_window_size.x) && (std::abs(dy) < (int)this->_window_size.y) ) this->scroll(dx, dy);
+        else {
+        	this->drawn_center = this->level_center, this->drawn_zoom = this->_zoom, this->drawn_valid = true;
+        	for (unsigned int marker_id : this->drawn_markers) this->MapMarkerWidgets[marker_id]->reset_drawn_orient_flag();
+        	this->erased_markers.swap(this->drawn_markers), this->drawn_markers.clear(), this->z_top = 0;
+        	if (this->render_bands != 1) this->draw_bands();
+        	else {
+        		//Draw a background
+        		this->draw_background(cv::Rect(0, 0, this->_window_size.x, this->_window_size.y));
+        		//Draw markers found in the spatial index in the registration order
+        		this->marker_draw_window();
+        	}
+        	this->marker_release_erased();
+        }
+        //Let the background source load the area ahead of the pan
+        this->_model->background->prefetch(this->_zoom, cv::Rect(this->level_center.x - this->_window_proj.x, this->level_center.y - this->_window_proj.y, this->_window_proj.x + this->_window_proj.size_x, this->_window_proj.y + this->_window_proj.size_y), dx, dy);
+    }
+
+    //This function returns the areas of the output image changed since the previous call; overlapping areas are merged
+    std::vector<cv::Rect> take_damage(void) {
+    	damage_merge(this->damage_rects);
+    	std::vector<cv::Rect> damage_rects;
+    	damage_rects.swap(this->damage_rects);
+    	return damage_rects;
+    }
+
+    //This function returns the render counters since the previous call and starts a new stats frame; the frame is written into the trace if it is open
+    map_stats_t take_stats(void) {
+    	map_stats_t stats = this->stats;
+    	stats.markers_visible = (unsigned int)this->drawn_markers.size();
+    	if (this->stats_trace) fprintf(this->stats_trace.get(), "%llu,%u,%u,%u,%u,%u,%u,%llu,%llu,%.3f,%.3f,%.3f,%.3f,%.3f\n", stats.frame, stats.markers_visible, stats.markers_culled, stats.markers_drawn, stats.markers_erased, stats.markers_cascaded, stats.backups, stats.backup_pixels, stats.pixels_blitted, stats.time_background, stats.time_scroll, stats.time_cascade, stats.time_erase, stats.time_draw);
+    	this->stats = map_stats_t(), this->stats.frame = stats.frame + 1;
+    	return stats;
+    }
+
+    //This function opens the CSV trace of the stats frames written by take_stats(); an empty path closes it
+    void set_stats_trace(const std::string& path) {
+    	this->stats_trace.reset();
+    	if (path.empty()) return;
+    	this->stats_trace.reset(std::fopen(path.c_str(), "w"));
+    	if (!this->stats_trace) throw("Failed to open the stats trace");
+    	fprintf(this->stats_trace.get(), "frame,visible,culled,drawn,erased,cascaded,backups,backup_pixels,pixels_blitted,background_us,scroll_us,cascade_us,erase_us,draw_us\n");
+    }
+
+    //This method register photo widget in the map; every view of the map gets it
+    unsigned int marker_add(unsigned int map_x,unsigned int map_y,unsigned char color[3], float fshape_x, float fshape_y, unsigned int border_x, unsigned int border_y, unsigned int length_x, unsigned int length_y, const cv::Mat& src_pimage) {
+    	return this->_model->marker_add(map_x, map_y, color, fshape_x, fshape_y, border_x, border_y, length_x, length_y, src_pimage);
+    }
+
+    //The function update marker on the map; every view of the map showing it is updated
+    void marker_update(unsigned int marker_id, unsigned int x, unsigned int y) { this->_model->marker_update(marker_id, x, y); }
+
+    //The function update several markers at once: the markers under all old frames are erased and redrawn once in the stacking order,
+    //then the moved markers are drawn on top in the batch order. A marker listed twice gets the last coordinates. Every view of the map showing
+    //the markers is updated
+    void marker_update_batch(const std::vector<unsigned int>& marker_ids, const std::vector<coord2D_t<unsigned int>>& coords) { this->_model->marker_update_batch(marker_ids, coords); }
+};
+
+inline unsigned int MapModel::marker_add(unsigned int map_x,unsigned int map_y,unsigned char color[3], float fshape_x, float fshape_y, unsigned int border_x, unsigned int border_y, unsigned int length_x, unsigned int length_y, const cv::Mat& src_pimage) {
+	unsigned int marker_id = (unsigned int)this->markers.size();
+	sprite_key_t key(src_pimage.data, src_pimage.rows, src_pimage.cols, (size_t)src_pimage.step, color[0], color[1], color[2], fshape_x, fshape_y, border_x, border_y, length_x, length_y);
+	std::shared_ptr<const MapMarkerWidget::sprite_t>& sprite = this->marker_sprites[key];
+	if (!sprite) sprite = std::make_shared<const MapMarkerWidget::sprite_t>(color, fshape_x, fshape_y, border_x, border_y, length_x, length_y, src_pimage);
+	this->markers.push_back(sprite);
+	this->marker_coords2D.push_back({ .x = map_x, .y = map_y });
+	this->marker_flags.push_back(0);
+	this->marker_grid.insert(marker_id, this->marker_coords2D.back());
+	if (this->marker_reach.x < sprite->offset.x + sprite->length.x) this->marker_reach.x = sprite->offset.x + sprite->length.x;
+	if (this->marker_reach.y < sprite->offset.y + sprite->length.y) this->marker_reach.y = sprite->offset.y + sprite->length.y;
+	for (MapWidget* view : this->views) view->marker_added(sprite);
+	return marker_id;
+}
+
+inline void MapModel::marker_update_batch(const std::vector<unsigned int>& marker_ids, const std::vector<coord2D_t<unsigned int>>& coords) {
+	if (marker_ids.size() != coords.size()) throw("Inconsistent marker batch");
+	//Collect the moved markers once each and move them in the spatial index
+	std::vector<unsigned int>& moved_markers = this->batch_markers;
+	for (unsigned int _i=0 ; _i != marker_ids.size(); _i++) {
+		unsigned int marker_id = marker_ids[_i];
+		if ( (marker_id < this->markers.size()) && ( (this->marker_coords2D[marker_id].x != coords[_i].x) || (this->marker_coords2D[marker_id].y != coords[_i].y) ) ) {
+			if (this->marker_flags[marker_id]) moved_markers.erase(std::find(moved_markers.begin(), moved_markers.end(), marker_id));
+			else this->marker_flags[marker_id] = 1;
+			moved_markers.push_back(marker_id);
+			this->marker_grid.move(marker_id, this->marker_coords2D[marker_id], coords[_i]);
+			this->marker_coords2D[marker_id] = coords[_i];
+		}
+	}
+	for (unsigned int marker_id : moved_markers) this->marker_flags[marker_id] = 0;
+	//Pass the moves to the views they touch
+	for (MapWidget* view : this->views)
+		if (view->marker_touched(moved_markers)) this->touched_views.push_back(view);
+	try { this->for_views(this->touched_views, [&moved_markers](MapWidget* view) { view->marker_moved(moved_markers); }); }
+	catch (...) { this->touched_views.clear(), moved_markers.clear(); throw; }
+	this->touched_views.clear(), moved_markers.clear();
+}
+
+inline void MapModel::draw(void) { this->for_views(this->views, [](MapWidget* view) { view->draw(); }); }
+
+//This object runs a MapWidget on its own render thread: pans, new markers and marker moves are queued by any thread and the rendered
+//frames are published into a ring of frame buffers; consumers read the latest frame in place while the next one is rendered
+class MapWidgetPipeline{
+private:
+	static const unsigned int damage_limit = 64; //Pending areas of a frame buffer kept before they are merged into one
+	//A frame buffer
+	struct slot_t {
+		cv::Mat image;
+		std::vector<cv::Rect> pending;        //Areas changed since the buffer was written last time
+		unsigned long long sequence;          //Published frame number
+		std::atomic<unsigned int> readers;    //Consumers holding the buffer
+	};
+	//The features of a queued new marker (MapWidget::marker_add())
+	struct marker_t {
+		unsigned char color[3];
+		float fshape_x, fshape_y;
+		unsigned int border_x, border_y, length_x, length_y;
+		cv::Mat src_pimage;
+	};
+	//A queued command
+	struct command_t {
+		enum KIND : unsigned int { CENTER, ZOOM, MARKER, INVALIDATE, MARKER_ADD } kind;
+		unsigned int id, x, y;
+		std::shared_ptr<const marker_t> marker; //The new marker of MARKER_ADD
+	};
+
+	std::unique_ptr<MapWidget> map;
+	std::vector<std::unique_ptr<slot_t>> slots;
+	std::atomic<unsigned int> latest;         //The latest published buffer
+	unsigned long long sequence;              //The last published frame number
+	std::deque<command_t> commands;
+	unsigned long long commands_queued, commands_done;
+	unsigned int markers;                     //Markers of the map including the queued new ones
+	std::exception_ptr error;                 //The render failure; it is re-thrown by the next command
+	std::mutex mutex;
+	std::condition_variable commands_cv, done_cv;
+	bool stop;
+	std::thread render_thread;
+
+	//This function queues the command; a new marker gets its id here, it returns the id
+	unsigned int push(command_t command) {
+		{
+			std::lock_guard<std::mutex> lock(this->mutex);
+			if (this->error) std::rethrow_exception(this->error);
+			if (command.kind == command_t::MARKER_ADD) command.id = this->markers++;
+			this->commands.push_back(command), this->commands_queued++;
+		}
+		this->commands_cv.notify_one();
+		return command.id;
+	}
+
+	//This function applies the commands to the map; consecutive marker moves make one batch and consecutive pans make one draw
+	void apply(const std::deque<command_t>& commands) {
+		std::vector<unsigned int> marker_ids;
+		std::vector<coord2D_t<unsigned int>> marker_coords;
+		bool redraw = false;
+		for (const command_t& command : commands) {
+			if (command.kind == command_t::MARKER) {
+				if (redraw) this->map->draw(), redraw = false; //The markers are placed at the current center and zoom
+				marker_ids.push_back(command.id), marker_coords.push_back({ command.x, command.y });
+				continue;
+			}
+			if (!marker_ids.empty()) this->map->marker_update_batch(marker_ids, marker_coords), marker_ids.clear(), marker_coords.clear();
+			switch (command.kind) {
+				case command_t::CENTER     : { if (this->map->set_center(command.x, command.y) == +1) redraw = true; break; }
+				case command_t::ZOOM       : { if (this->map->set_zoom(command.x) == +1) redraw = true; break; }
+				case command_t::INVALIDATE : { this->map->invalidate(), redraw = true; break; }
+				case command_t::MARKER_ADD : {
+					const marker_t& marker = *command.marker;
+					unsigned char color[3] = { marker.color[0], marker.color[1], marker.color[2] };
+					if (this->map->marker_add(command.x, command.y, color, marker.fshape_x, marker.fshape_y, marker.border_x, marker.border_y, marker.length_x, marker.length_y, marker.src_pimage) != command.id) throw("The pipeline marker id does not match the map one");
+					redraw = true; //The new marker is drawn if it is in the window
+					break; }
+				default                    : ;
+			}
+		}
+		if (!marker_ids.empty()) this->map->marker_update_batch(marker_ids, marker_coords);
+		if (redraw) this->map->draw();
+	}
+
+	//This function copies the rendered changes into a free frame buffer and publishes it
+	void publish(void) {
+		std::vector<cv::Rect> damage = this->map->take_damage();
+		if (damage.empty()) return;
+		for (std::unique_ptr<slot_t>& slot : this->slots) {
+			slot->pending.insert(slot->pending.end(), damage.begin(), damage.end());
+			damage_collapse(slot->pending, MapWidgetPipeline::damage_limit);
+		}
+		//A free buffer is neither the latest one nor held by a consumer; there is one if the consumers hold fewer than slots-1 buffers
+		unsigned int free_slot = this->latest;
+		while (true) {
+			for (unsigned int _s=0 ; _s != this->slots.size(); _s++)
+				if ( (_s != this->latest.load()) && (!this->slots[_s]->readers.load()) ) { free_slot = _s; break; }
+			if (free_slot != this->latest.load()) break;
+			std::this_thread::yield();
+		}
+		slot_t& slot = *this->slots[free_slot];
+		for (const cv::Rect& area : slot.pending) {
+			cv::Mat fragment_dst(slot.image, area);
+			cv::Mat(this->map->image, area).copyTo(fragment_dst);
+		}
+		slot.pending.clear(), slot.sequence = ++this->sequence;
+		this->latest.store(free_slot);
+	}
+
+	//The render worker
+	void render_loop(void) {
+		std::unique_lock<std::mutex> lock(this->mutex);
+		while (true) {
+			this->commands_cv.wait(lock, [this] { return (this->stop) || (!this->commands.empty()); });
+			if (this->stop) return;
+			std::deque<command_t> commands;
+			commands.swap(this->commands);
+			lock.unlock();
+			try { this->apply(commands), this->publish(); }
+			catch (...) {
+				lock.lock();
+				if (!this->error) this->error = std::current_exception();
+				lock.unlock();
+			}
+			lock.lock();
+			this->commands_done += commands.size();
+			this->done_cv.notify_all();
+		}
+	}
+public:
+	//A published frame; the buffer is not written while the frame is held
+	class frame_t {
+	private:
+		slot_t* slot;
+		friend class MapWidgetPipeline;
+		frame_t(slot_t* slot) : slot(slot) { }
+	public:
+		frame_t(frame_t&& other) : slot(other.slot) { other.slot = nullptr; }
+		frame_t(const frame_t&) = delete;
+		frame_t& operator=(const frame_t&) = delete;
+		~frame_t() { if (this->slot) this->slot->readers.fetch_sub(1); }
+		const cv::Mat& image(void) const { return this->slot->image; }       //The frame pixels (no copy)
+		unsigned long long sequence(void) const { return this->slot->sequence; } //The frame number; it grows with every published frame
+	};
+
+	//The constructor takes over the map with its markers; the map is drawn and published as the first frame. The map must be the only
+	//view of its model, and no views can be added to the model while the pipeline runs.
+	//The pipeline needs (consumers holding a frame at once) + 2 frame buffers to never wait for a consumer
+	MapWidgetPipeline(std::unique_ptr<MapWidget> map, unsigned int slots = 3) : map(std::move(map)) {
+		if (!this->map) throw("No map for the pipeline");
+		if (slots < 2) throw("The pipeline needs two frame buffers at least");
+		if (this->map->model->views.size() != 1) throw("The pipeline map shares its model with other views");
+		this->map->draw(), this->map->take_damage();
+		for (unsigned int _s=0 ; _s != slots; _s++) {
+			this->slots.push_back(std::make_unique<slot_t>());
+			slot_t& slot = *this->slots.back();
+			slot.image = (_s) ? cv::Mat(this->map->image.rows, this->map->image.cols, this->map->image.type()) : this->map->image.clone();
+			if (_s) slot.pending.push_back(cv::Rect(0, 0, this->map->image.cols, this->map->image.rows));
+			slot.sequence = 0, slot.readers = 0;
+		}
+		this->latest = 0, this->sequence = 0, this->commands_queued = 0, this->commands_done = 0, this->markers = this->map->model->markers_count(), this->stop = false;
+		this->map->model->pipelined = true;
+		this->render_thread = std::thread(&MapWidgetPipeline::render_loop, this);
+	}
+	~MapWidgetPipeline() {
+		{ std::lock_guard<std::mutex> lock(this->mutex); this->stop = true; }
+		this->commands_cv.notify_all();
+		this->render_thread.join();
+		this->map->model->pipelined = false;
+	}
+
+	//These functions queue the map commands; they re-throw a failure of the render thread
+	void set_center(unsigned int window_center_x, unsigned int window_center_y) { this->push({ command_t::CENTER, 0, window_center_x, window_center_y }); }
+	void set_zoom(unsigned int zoom) { this->push({ command_t::ZOOM, 0, zoom, 0 }); }
+	void marker_update(unsigned int marker_id, unsigned int x, unsigned int y) { this->push({ command_t::MARKER, marker_id, x, y }); }
+	void invalidate(void) { this->push({ command_t::INVALIDATE, 0, 0, 0 }); }
+
+	//This function queues a new marker (MapWidget::marker_add()) and returns its id, which the queued moves may use at once.
+	//The marker image is shared rather than copied (identical markers share a sprite by it), so it must not be changed afterwards
+	unsigned int marker_add(unsigned int map_x,unsigned int map_y,unsigned char color[3], float fshape_x, float fshape_y, unsigned int border_x, unsigned int border_y, unsigned int length_x, unsigned int length_y, const cv::Mat& src_pimage) {
+		std::shared_ptr<marker_t> marker = std::make_shared<marker_t>();
+		marker->color[0] = color[0], marker->color[1] = color[1], marker->color[2] = color[2];
+		marker->fshape_x = fshape_x, marker->fshape_y = fshape_y, marker->border_x = border_x, marker->border_y = border_y, marker->length_x = length_x, marker->length_y = length_y;
+		marker->src_pimage = src_pimage;
+		return this->push({ command_t::MARKER_ADD, 0, map_x, map_y, marker });
+	}
+
+	//This function waits until the commands queued so far are rendered and published
+	void flush(void) {
+		std::unique_lock<std::mutex> lock(this->mutex);
+		unsigned long long queued = this->commands_queued;
+		this->done_cv.wait(lock, [this, queued] { return this->commands_done >= queued; });
+		if (this->error) std::rethrow_exception(this->error);
+	}
+
+	//This function returns the latest published frame without copying it; it never blocks
+	frame_t acquire(void) const {
+		while (true) {
+			unsigned int slot = this->latest.load();
+			this->slots[slot]->readers.fetch_add(1);
+			if (this->latest.load() == slot) return frame_t(this->slots[slot].get()); //Still the latest: the renderer cannot pick it any more
+			this->slots[slot]->readers.fetch_sub(1);
+		}
+	}
+};
+
+//This object publishes rendered frames into a POSIX shared memory ring of frame slots for another process (MapFrameReader).
+//A slot carries the frame number and the damage against the previous frame under a sequence lock; a slot is brought up to
+//date by copying only the areas changed since it was written last time, so a frame costs its damage rather than a full copy
+class MapFrameExporter{
+public:
+	static const unsigned int damage_max = 32; //Damage rectangles kept in a slot; more are merged into their bounding one
+	struct header_t {
+		char magic[8];                          //"MAPFRAME"
+		uint32_t size_x, size_y, channels, slots;
+		uint64_t slot_stride, pixels_offset;    //Bytes from a slot header to the next one and to its pixels
+		std::atomic<uint64_t> latest;           //The latest published frame number; 0 is none. Frame n is in slot n % slots
+	};
+	struct slot_header_t {
+		std::atomic<uint64_t> lock;             //Sequence lock: odd while the slot is written
+		uint64_t sequence;                      //Frame number
+		uint32_t damage_count;                  //0 means the whole frame
+		int32_t damage[damage_max][4];          //x, y, width, height
+	};
+
+	//This function returns the page aligned layout of the ring: the size of the header part, the slot stride and the pixels offset in a slot
+	static void layout(unsigned int size_x, unsigned int size_y, unsigned int channels, size_t& header_size, size_t& slot_stride, size_t& pixels_offset) {
+		size_t page = (size_t)sysconf(_SC_PAGESIZE);
+		header_size = (sizeof(header_t) + page - 1) / page * page;
+		pixels_offset = (sizeof(slot_header_t) + page - 1) / page * page;
+		slot_stride = (pixels_offset + (size_t)size_x * size_y * channels + page - 1) / page * page;
+	}
+private:
+	std::string name;
+	unsigned char* data;  //The mapping
+	size_t data_size, header_size;
+	header_t* header;
+	cv::Size size;
+	std::vector<std::vector<cv::Rect>> pending; //Areas changed since the slot was written last time
+	uint64_t sequence;
+
+	slot_header_t* slot_header(unsigned int slot) { return (slot_header_t*)(this->data + this->header_size + slot * this->header->slot_stride); }
+	cv::Mat slot_image(unsigned int slot) { return cv::Mat(this->size.height, this->size.width, CV_8UC3, (unsigned char*)this->slot_header(slot) + this->header->pixels_offset); }
+public:
+	//The constructor creates (or re-creates) the shared memory object; the name is a POSIX one, e.g. "/map_frames"
+	MapFrameExporter(const std::string& name, unsigned int size_x, unsigned int size_y, unsigned int slots = 4) : name(name) {
+		if ( (!size_x) || (!size_y) || (slots < 2) ) throw("Incorrect frame ring geometry");
+		size_t slot_stride, pixels_offset;
+		MapFrameExporter::layout(size_x, size_y, 3, this->header_size, slot_stride, pixels_offset);
+		this->data_size = this->header_size + slots * slot_stride;
+		int fd = shm_open(name.c_str(), O_CREAT | O_RDWR, 0644);
+		if (fd < 0) throw("Failed to create a frame ring");
+		if (ftruncate(fd, (off_t)this->data_size)) { close(fd); shm_unlink(name.c_str()); throw("Failed to size a frame ring"); }
+		void* mapping = mmap(nullptr, this->data_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+		if (mapping == MAP_FAILED) { shm_unlink(name.c_str()); throw("Failed to map a frame ring"); }
+		this->data = (unsigned char*)mapping, this->header = (header_t*)mapping, this->size = cv::Size(size_x, size_y), this->sequence = 0;
+		std::memset(this->header->magic, 0, 8);
+		this->header->size_x = size_x, this->header->size_y = size_y, this->header->channels = 3, this->header->slots = slots, this->header->slot_stride = slot_stride, this->header->pixels_offset = pixels_offset;
+		this->header->latest.store(0);
+		for (unsigned int _s=0 ; _s != slots; _s++) {
+			slot_header_t* slot = this->slot_header(_s);
+			slot->lock.store(0), slot->sequence = 0, slot->damage_count = 0;
+		}
+		this->pending.assign(slots, std::vector<cv::Rect>(1, cv::Rect(0, 0, size_x, size_y)));
+		std::atomic_thread_fence(std::memory_order_release);
+		std::memcpy(this->header->magic, "MAPFRAME", 8); //Readers attach once the magic is there
+	}
+	~MapFrameExporter() {
+		munmap(this->data, this->data_size);
+		shm_unlink(this->name.c_str());
+	}
+
+	//This function publishes the frame given the areas changed since the previous one (MapWidget::take_damage()); the first frame is copied whole.
+	//It returns false if there is nothing to publish
+	bool publish(const cv::Mat& image, const std::vector<cv::Rect>& damage) {
+		if ( (image.type() != CV_8UC3) || (image.cols != this->size.width) || (image.rows != this->size.height) ) throw("The frame does not match the frame ring");
+		if ( (damage.empty()) && (this->sequence) ) return false;
+		for (std::vector<cv::Rect>& pending : this->pending) {
+			pending.insert(pending.end(), damage.begin(), damage.end());
+			damage_collapse(pending, MapFrameExporter::damage_max);
+		}
+		uint64_t sequence = this->sequence + 1;
+		unsigned int slot = (unsigned int)(sequence % this->header->slots);
+		slot_header_t* slot_header = this->slot_header(slot);
+		cv::Mat slot_image = this->slot_image(slot);
+		slot_header->lock.store(slot_header->lock.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		for (const cv::Rect& area : this->pending[slot]) {
+			cv::Mat fragment_dst(slot_image, area);
+			cv::Mat(image, area).copyTo(fragment_dst);
+		}
+		//The slot keeps the damage as it is or its bounding rectangle; the written pending list is the scratch list
+		std::vector<cv::Rect>& slot_damage = this->pending[slot];
+		slot_damage.assign(damage.begin(), damage.end()), damage_collapse(slot_damage, MapFrameExporter::damage_max);
+		slot_header->sequence = sequence, slot_header->damage_count = (this->sequence) ? (uint32_t)slot_damage.size() : 0;
+		for (unsigned int _i=0 ; _i != slot_header->damage_count; _i++) slot_header->damage[_i][0] = slot_damage[_i].x, slot_header->damage[_i][1] = slot_damage[_i].y, slot_header->damage[_i][2] = slot_damage[_i].width, slot_header->damage[_i][3] = slot_damage[_i].height;
+		slot_damage.clear();
+		slot_header->lock.store(slot_header->lock.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+		this->header->latest.store(sequence, std::memory_order_release);
+		this->sequence = sequence;
+		return true;
+	}
+
+	//This function publishes the current map frame with its damage
+	bool publish(MapWidget& map) { return this->publish(map.image, map.take_damage()); }
+};
+
+//This object attaches to a frame ring of a MapFrameExporter and reads its frames in place
+class MapFrameReader{
+public:
+	//A frame read in place; it stays valid while validate() returns true
+	struct frame_t {
+		cv::Mat image;                   //The frame pixels in the shared memory (read-only)
+		uint64_t sequence;               //Frame number
+		std::vector<cv::Rect> damage;    //Areas changed since the frame sequence-1; empty means the whole frame
+		uint64_t lock;                   //The slot lock value when the frame was taken
+		unsigned int slot;
+	};
+private:
+	unsigned char* data;  //The mapping
+	size_t data_size, header_size;
+	const MapFrameExporter::header_t* header;
+
+	const MapFrameExporter::slot_header_t* slot_header(unsigned int slot) const { return (const MapFrameExporter::slot_header_t*)(this->data + this->header_size + slot * this->header->slot_stride); }
+public:
+	MapFrameReader(const std::string& name) {
+		int fd = shm_open(name.c_str(), O_RDONLY, 0);
+		struct stat st;
+		if ( (fd < 0) || (fstat(fd, &st)) || ((size_t)st.st_size < sizeof(MapFrameExporter::header_t)) ) { if (fd >= 0) close(fd); throw("Failed to open a frame ring"); }
+		this->data_size = (size_t)st.st_size;
+		void* mapping = mmap(nullptr, this->data_size, PROT_READ, MAP_SHARED, fd, 0);
+		close(fd);
+		if (mapping == MAP_FAILED) throw("Failed to map a frame ring");
+		this->data = (unsigned char*)mapping, this->header = (const MapFrameExporter::header_t*)mapping;
+		size_t slot_stride, pixels_offset;
+		if (std::memcmp(this->header->magic, "MAPFRAME", 8)) { munmap(this->data, this->data_size); throw("Incorrect frame ring"); }
+		std::atomic_thread_fence(std::memory_order_acquire);
+		MapFrameExporter::layout(this->header->size_x, this->header->size_y, this->header->channels, this->header_size, slot_stride, pixels_offset);
+		if ( (this->header->channels != 3) || (this->header->slot_stride != slot_stride) || (this->data_size < this->header_size + this->header->slots * slot_stride) ) { munmap(this->data, this->data_size); throw("Incorrect frame ring"); }
+	}
+	~MapFrameReader() { munmap(this->data, this->data_size); }
+
+	//This function returns the frame size
+	cv::Size size(void) const { return cv::Size(this->header->size_x, this->header->size_y); }
+
+	//This function returns the latest published frame number; 0 is none
+	uint64_t latest(void) const { return this->header->latest.load(std::memory_order_acquire); }
+
+	//This function takes the latest frame without copying its pixels; it returns false if there is no frame yet.
+	//The pixels may be overwritten by the exporter once it has published slots-1 newer frames: check validate() after using them
+	bool acquire(frame_t& frame) const {
+		while (true) {
+			uint64_t sequence = this->latest();
+			if (!sequence) return false;
+			frame.slot = (unsigned int)(sequence % this->header->slots);
+			const MapFrameExporter::slot_header_t* slot_header = this->slot_header(frame.slot);
+			frame.lock = slot_header->lock.load(std::memory_order_acquire);
+			if (frame.lock & 1) continue; //Being written; the latest frame is another one already
+			frame.sequence = slot_header->sequence;
+			frame.damage.resize(std::min<uint32_t>(slot_header->damage_count, (uint32_t)MapFrameExporter::damage_max));
+			for (unsigned int _i=0 ; _i != frame.damage.size(); _i++) frame.damage[_i] = cv::Rect(slot_header->damage[_i][0], slot_header->damage[_i][1], slot_header->damage[_i][2], slot_header->damage[_i][3]);
+			frame.image = cv::Mat(this->header->size_y, this->header->size_x, CV_8UC3, (unsigned char*)slot_header + this->header->pixels_offset);
+			if (this->validate(frame)) return true;
+		}
+	}
+
+	//This function returns true if the frame pixels read so far were not overwritten
+	bool validate(const frame_t& frame) const {
+		std::atomic_thread_fence(std::memory_order_acquire);
+		return this->slot_header(frame.slot)->lock.load(std::memory_order_relaxed) == frame.lock;
+	}
+};
+
+#endif /* MAP_WIDGET_H_ */